@@ -0,0 +1,45 @@
+/*
+**  Stress test firmware for the fd-serial module
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Echo every received byte, nulls included, as soon as the
+**  transmitter will take it. Used by "make simbench".
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "fd-serial.h"
+
+/*  Set highest frequency CPU operation.
+**  Startup frequency is assumed to be 1 MHz;
+**  8 MHz for the internal clock.
+*/
+
+void set_cpu_8mhz(void) {
+	// Prepare for clock change
+	CLKPR = 1<<CLKPCE;
+	// Set the internal clock
+	CLKPR = 0<<CLKPS3 | 0<<CLKPS2 | 0<<CLKPS1 | 0<<CLKPS0;
+	// System clock is now 8 MHz
+}
+
+int main(void) {
+	// Disable interrupts
+	cli();
+
+	// Setup the clock
+	set_cpu_8mhz();
+
+	// Enable the software UART
+	fdserial_init();
+
+	// Enable interrupts
+	sei();
+
+	while (1) {
+		if (fdserial_available() && fdserial_sendok()) {
+			fdserial_send(fdserial_recv());
+		}
+	}
+}
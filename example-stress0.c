@@ -0,0 +1,44 @@
+/*
+**  Stress test firmware for the serial0 module
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Echo every received byte. serial0 is half duplex, so this
+**  shows how close to back-to-back input it can keep up.
+**  Used by "make simbench".
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "serial0.h"
+
+/*  Set highest frequency CPU operation.
+**  Startup frequency is assumed to be 1 MHz;
+**  8 MHz for the internal clock.
+*/
+
+void set_cpu_8mhz(void) {
+	// Prepare for clock change
+	CLKPR = 1<<CLKPCE;
+	// Set the internal clock
+	CLKPR = 0<<CLKPS3 | 0<<CLKPS2 | 0<<CLKPS1 | 0<<CLKPS0;
+	// System clock is now 8 MHz
+}
+
+int main(void) {
+	// Disable interrupts
+	cli();
+
+	// Setup the clock
+	set_cpu_8mhz();
+
+	// Enable the software UART
+	serial0_init();
+
+	// Enable interrupts
+	sei();
+
+	while (1) {
+		serial0_send(serial0_recv());
+	}
+}
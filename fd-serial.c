@@ -6,35 +6,280 @@
 **     This code uses Timer/Counter 1
 **     RX is connected to PORTB2 (INT0), pin 7
 **     TX is connected to PORTB3, pin 2
-**     Speed 9600 bps, full duplex
+**        or with FDSERIAL_USI_TX, PORTB1 (DO), pin 6, sent by the
+**        USI clocked from Timer/Counter 0
+**     With FDSERIAL_ASM_TX the TX bit interrupt is in fd-serial-tx.S
+**     Speed SERIAL_RATE bps (default 9600), full duplex
 */
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <stdint.h>
+#if defined(FDSERIAL_SLEEP) || defined(FDSERIAL_POWER_DOWN)
+#include <avr/sleep.h>
+#endif
 
 #include "fd-serial.h"
 
+#if SERIAL_PARITY != SERIAL_PARITY_NONE
+#include <util/parity.h>
+#endif
+
 #ifndef CPU_FREQ
 #define CPU_FREQ 8000000
 #endif
 
-#if SERIAL_RATE == 9600
-// Prescaler CK/4
+// Largest acceptable bit rate error, in tenths of a percent
+#ifndef SERIAL_MAX_ERROR
+#define SERIAL_MAX_ERROR 20
+#endif
+
+// Fewest CPU cycles per bit which leave time for the TX and RX
+// interrupts to both run within one bit time. Receiving back to
+// back frames while sending needs more; see SERIAL_RATE.
+#ifndef SERIAL_MIN_CYCLES
+#define SERIAL_MIN_CYCLES 128
+#endif
+
+// The ring indexes run freely through 0-255 and are masked on
+// use, so the sizes must be powers of two. head - tail is then the
+// number of bytes held, which must fit in a uint8_t.
+#ifdef RING_BUFFER
+#if (RING_BUFFER & (RING_BUFFER - 1)) || RING_BUFFER > 128
+#error "RING_BUFFER must be a power of two, 128 or less"
+#endif
+#define RX_MASK (RING_BUFFER - 1)
+#endif
+
+#ifdef TX_RING_BUFFER
+#if (TX_RING_BUFFER & (TX_RING_BUFFER - 1)) || TX_RING_BUFFER > 128
+#error "TX_RING_BUFFER must be a power of two, 128 or less"
+#endif
+#define TX_MASK (TX_RING_BUFFER - 1)
+#endif
+
+#if RX_OVERFLOW != RX_DROP_OLDEST && RX_OVERFLOW != RX_DROP_NEWEST && RX_OVERFLOW != RX_STOP
+#error "RX_OVERFLOW must be RX_DROP_OLDEST, RX_DROP_NEWEST or RX_STOP"
+#endif
+
+#ifdef FDSERIAL_FRAMES
+#ifndef RING_BUFFER
+#error "FDSERIAL_FRAMES needs RING_BUFFER"
+#endif
+#if RX_OVERFLOW == RX_DROP_OLDEST
+#error "FDSERIAL_FRAMES needs RX_OVERFLOW RX_DROP_NEWEST or RX_STOP"
+#endif
+#if (FDSERIAL_FRAMES & (FDSERIAL_FRAMES - 1)) || FDSERIAL_FRAMES > 128
+#error "FDSERIAL_FRAMES must be a power of two, 128 or less"
+#endif
+#if FDSERIAL_T15 < 1 || FDSERIAL_T15 >= FDSERIAL_T35 || FDSERIAL_T35 > 255
+#error "FDSERIAL_T15 and FDSERIAL_T35 must be 1 to 255, FDSERIAL_T15 the smaller"
+#endif
+#define FRAME_MASK (FDSERIAL_FRAMES - 1)
+
+// rx_state between characters, timing the silence
+#define RX_GAP 7
+#endif
+
+#ifdef FDSERIAL_DELIMITER
+#ifndef RING_BUFFER
+#error "FDSERIAL_DELIMITER needs RING_BUFFER"
+#endif
+#ifdef FDSERIAL_FRAMES
+#error "FDSERIAL_DELIMITER cannot be used with FDSERIAL_FRAMES"
+#endif
+#endif
+
+#if SERIAL_DATA_BITS < 5 || SERIAL_DATA_BITS > 9
+#error "SERIAL_DATA_BITS must be from 5 to 9"
+#endif
+
+#if SERIAL_PARITY != SERIAL_PARITY_NONE && SERIAL_PARITY != SERIAL_PARITY_EVEN && SERIAL_PARITY != SERIAL_PARITY_ODD
+#error "SERIAL_PARITY must be SERIAL_PARITY_NONE, SERIAL_PARITY_EVEN or SERIAL_PARITY_ODD"
+#endif
+
+#if SERIAL_STOP_BITS != 1 && SERIAL_STOP_BITS != 2
+#error "SERIAL_STOP_BITS must be 1 or 2"
+#endif
+
+#if defined(FDSERIAL_ADDRESS) && SERIAL_DATA_BITS != 9
+#error "FDSERIAL_ADDRESS needs SERIAL_DATA_BITS 9"
+#endif
+
+#if SERIAL_BREAK_BITS <= FRAME_LOW_BITS || SERIAL_BREAK_BITS > 255
+#error "SERIAL_BREAK_BITS must exceed FRAME_LOW_BITS, the all-low frame length, and be at most 255"
+#endif
+
+#if FDSERIAL_ALARMS < 1 || FDSERIAL_ALARMS > 8
+#error "FDSERIAL_ALARMS must be from 1 to 8"
+#endif
+
+#if defined(FDSERIAL_TICKS) && defined(FDSERIAL_STOP_TIMER)
+#error "FDSERIAL_TICKS needs Timer1 running, so not FDSERIAL_STOP_TIMER"
+#endif
+
+#if defined(FDSERIAL_TICKS) && defined(FDSERIAL_AUTOBAUD)
+#error "FDSERIAL_TICKS counts bit times, which autobaud stops, so not FDSERIAL_AUTOBAUD"
+#endif
+
+#if CPU_FREQ / SERIAL_RATE < SERIAL_MIN_CYCLES
+#error "SERIAL_RATE is too fast for CPU_FREQ"
+#endif
+
+// CPU cycles per bit, rounded up
+#define SERIAL_CYCLES ((CPU_FREQ + SERIAL_RATE - 1) / SERIAL_RATE)
+
+// Timer1 counts at most 256 ticks per bit. Use the smallest
+// prescaler which fits, for the finest bit timing.
+#if SERIAL_CYCLES <= 256
+#define PRESCALER (1<<CS10)
+#define PRESCALER_DIVISOR 1
+#elif SERIAL_CYCLES <= 512
+#define PRESCALER (1<<CS11)
+#define PRESCALER_DIVISOR 2
+#elif SERIAL_CYCLES <= 1024
 #define PRESCALER (1<<CS11 | 1<<CS10)
 #define PRESCALER_DIVISOR 4
-// 8000000 / PRESCALER / 9600 = 208.333
-#define SERIAL_TOP 207
-#define SERIAL_HALFBIT 104
+#elif SERIAL_CYCLES <= 2048
+#define PRESCALER (1<<CS12)
+#define PRESCALER_DIVISOR 8
+#elif SERIAL_CYCLES <= 4096
+#define PRESCALER (1<<CS12 | 1<<CS10)
+#define PRESCALER_DIVISOR 16
+#elif SERIAL_CYCLES <= 8192
+#define PRESCALER (1<<CS12 | 1<<CS11)
+#define PRESCALER_DIVISOR 32
+#elif SERIAL_CYCLES <= 16384
+#define PRESCALER (1<<CS12 | 1<<CS11 | 1<<CS10)
+#define PRESCALER_DIVISOR 64
+#else
+#error "SERIAL_RATE is too slow for CPU_FREQ"
+#endif
+
+#ifdef SERIAL_DITHER
+// e.g. 8000000 / PRESCALER / 9600 = 208.333, rounded up to 209.
+// Each bit is 2/3 of a tick too long, so the ISRs take a tick off
+// two bits in three: SERIAL_DITHER_STEP is the excess in 1/256ths
+// of a tick, added to an accumulator every bit.
+#define SERIAL_TICKS ((CPU_FREQ / PRESCALER_DIVISOR + SERIAL_RATE - 1) / SERIAL_RATE)
+#define SERIAL_DITHER_STEP (((SERIAL_TICKS * PRESCALER_DIVISOR * SERIAL_RATE - CPU_FREQ) * 256) \
+	/ (PRESCALER_DIVISOR * SERIAL_RATE))
+#else
+// e.g. 8000000 / PRESCALER / 9600 = 208.333
+#define SERIAL_TICKS ((CPU_FREQ / PRESCALER_DIVISOR + SERIAL_RATE / 2) / SERIAL_RATE)
+#endif
+#define SERIAL_TOP (SERIAL_TICKS - 1)
+#define SERIAL_HALFBIT (SERIAL_TICKS / 2)
+
+// Bit rate actually achieved, and its error in tenths of a percent.
+// With SERIAL_DITHER the mean bit time is within 1/256 of a tick.
+#ifndef SERIAL_DITHER
+#define SERIAL_ACTUAL (CPU_FREQ / PRESCALER_DIVISOR / SERIAL_TICKS)
+#define SERIAL_ERROR ((SERIAL_ACTUAL > SERIAL_RATE ? \
+	SERIAL_ACTUAL - SERIAL_RATE : SERIAL_RATE - SERIAL_ACTUAL) * 1000 / SERIAL_RATE)
+
+#if SERIAL_ERROR > SERIAL_MAX_ERROR
+#error "Bit rate error for SERIAL_RATE at CPU_FREQ exceeds SERIAL_MAX_ERROR"
+#endif
+#endif
+
+#ifdef FDSERIAL_POWER_DOWN
+#ifndef FDSERIAL_WAKEUP_CYCLES
+#define FDSERIAL_WAKEUP_CYCLES 10
+#endif
+
+// The start bit is sampled half a bit after its edge, so waking
+// must take less than that
+#if FDSERIAL_WAKEUP_CYCLES >= SERIAL_CYCLES / 2
+#error "FDSERIAL_WAKEUP_CYCLES must be under half a bit at SERIAL_RATE"
+#endif
+#endif
+
+#ifdef FDSERIAL_USI_TX
+#ifndef TX_RING_BUFFER
+#error "FDSERIAL_USI_TX needs TX_RING_BUFFER"
+#endif
+
+// Each frame goes out in two USI loads of 8 bits, the first load
+// sending 7 of them
+#if FRAME_BITS < 8
+#error "FDSERIAL_USI_TX needs frames of at least 8 bits"
+#endif
 
+// Timer0 clocks the USI once per bit, at CK/1, CK/8 or CK/64
+#define USI_CYCLES ((CPU_FREQ + SERIAL_RATE / 2) / SERIAL_RATE)
+
+#if USI_CYCLES <= 256
+#define USI_PRESCALER (1<<CS00)
+#define USI_DIVISOR 1
+#elif USI_CYCLES <= 2048
+#define USI_PRESCALER (1<<CS01)
+#define USI_DIVISOR 8
+#elif USI_CYCLES <= 16384
+#define USI_PRESCALER (1<<CS01 | 1<<CS00)
+#define USI_DIVISOR 64
 #else
-#error "Serial rates other than 9600 are not presently supported"
+#error "SERIAL_RATE is too slow for CPU_FREQ"
+#endif
+
+#define USI_TICKS ((CPU_FREQ / USI_DIVISOR + SERIAL_RATE / 2) / SERIAL_RATE)
+#define USI_ACTUAL (CPU_FREQ / USI_DIVISOR / USI_TICKS)
+#define USI_ERROR ((USI_ACTUAL > SERIAL_RATE ? \
+	USI_ACTUAL - SERIAL_RATE : SERIAL_RATE - USI_ACTUAL) * 1000 / SERIAL_RATE)
+
+#if USI_ERROR > SERIAL_MAX_ERROR
+#error "USI bit rate error for SERIAL_RATE at CPU_FREQ exceeds SERIAL_MAX_ERROR"
+#endif
+#endif
+
+#if defined(FDSERIAL_PROFILE_PIN) && (FDSERIAL_PROFILE_PIN) & (S1_TX_PIN | S1_RX_PIN)
+#error "FDSERIAL_PROFILE_PIN must not be the RX or TX pin"
+#endif
+
+#if defined(FDSERIAL_GPIOR) && defined(FDSERIAL_ASM_TX)
+#error "FDSERIAL_GPIOR and FDSERIAL_ASM_TX both use GPIOR0-2"
+#endif
+
+#ifdef FDSERIAL_ASM_TX
+#if defined(FDSERIAL_USI_TX)
+#error "FDSERIAL_ASM_TX and FDSERIAL_USI_TX cannot be used together"
+#endif
+#if defined(SERIAL_DITHER)
+#error "FDSERIAL_ASM_TX does not dither; undefine SERIAL_DITHER"
+#endif
 #endif
 
 /* Data structure used by this module */
 
 static struct fd_uart fd_uart1;
 
+#ifdef FDSERIAL_ASM_TX
+volatile uint8_t fdserial_tx_level;
+#endif
+
+// TX state, in GPIOR0-2 where fd-serial-tx.S can reach it
+#ifdef FDSERIAL_ASM_TX
+#define TX_STATE  TX_STATE_REG
+#define SEND_BYTE SEND_BYTE_REG
+#define SEND_BITS SEND_BITS_REG
+#else
+#define TX_STATE  fd_uart1.tx_state
+#ifndef FDSERIAL_GPIOR
+#define SEND_BYTE fd_uart1.send_byte
+#endif
+#define SEND_BITS fd_uart1.send_bits
+#endif
+
+// The most used bytes of RX and TX state, with FDSERIAL_GPIOR
+#ifdef FDSERIAL_GPIOR
+#define RX_STATE   GPIOR0
+#define RECV_SHIFT GPIOR1
+#define SEND_BYTE  GPIOR2
+#else
+#define RX_STATE   fd_uart1.rx_state
+#define RECV_SHIFT fd_uart1.recv_shift
+#endif
+
 /*
 **  Start the timer. The timer must be running while characters
 **  are being received or sent.
@@ -42,7 +287,7 @@ static struct fd_uart fd_uart1;
 
 static void _starttimer(void) {
 
-	TCCR1 |= PRESCALER;
+	TCCR1 |= fd_uart1.prescaler;
 }
 
 /*
@@ -52,14 +297,88 @@ static void _starttimer(void) {
 
 static void _stoptimer(void) {
 
-	TCCR1 &= ~PRESCALER;
+	TCCR1 &= ~( 1<<CS13 | 1<<CS12 | 1<<CS11 | 1<<CS10 );
+}
+
+/*
+**  With FDSERIAL_STOP_TIMER, restart the timer if it was stopped,
+**  from the start of a prescaler period.
+*/
+
+static inline void _wake_timer(void) {
+#ifdef FDSERIAL_STOP_TIMER
+	uint8_t sreg = SREG;
+
+	cli();
+	if (! (TCCR1 & ( 1<<CS13 | 1<<CS12 | 1<<CS11 | 1<<CS10 ))) {
+		GTCCR |= 1<<PSR1;
+		_starttimer();
+	}
+	SREG = sreg;
+#endif
+}
+
+/*
+**  With FDSERIAL_STOP_TIMER, stop the timer if nothing needs it: TX
+**  idle, no alarm running, RX waiting on INT0 for a start bit and
+**  autobaud not timing. Called with interrupts off.
+*/
+
+static inline void _timer_idle(void) {
+#ifdef FDSERIAL_STOP_TIMER
+	if (fd_uart1.send_ready && ! fd_uart1.alarms_set && (GIMSK & 1<<INT0)
+#ifdef FDSERIAL_FRAMES
+		&& RX_STATE != RX_GAP
+#endif
+#ifdef FDSERIAL_AUTOBAUD
+		&& ! fd_uart1.autobaud
+#endif
+		) {
+		_stoptimer();
+	}
+#endif
+}
+
+/*
+**  Let interrupts in again, restoring sreg. With FDSERIAL_SLEEP, also
+**  sleep in idle mode until the next one. Called with interrupts off
+**  just after finding there is nothing to do yet: sei takes effect
+**  after the following instruction, so an interrupt which came after
+**  that check is taken straight after sleep_cpu and wakes it.
+*/
+
+static inline void _idle(uint8_t sreg) {
+#ifdef FDSERIAL_SLEEP
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+#endif
+	SREG = sreg;
 }
 
+// Wait until cond is true, with FDSERIAL_SLEEP sleeping between
+// interrupts rather than spinning
+#ifdef FDSERIAL_SLEEP
+#define _wait_until(cond) do { \
+		uint8_t _sreg = SREG; \
+		cli(); \
+		if (cond) { \
+			SREG = _sreg; \
+			break; \
+		} \
+		_idle(_sreg); \
+	} while (1)
+#else
+#define _wait_until(cond) while (! (cond)) { }
+#endif
+
 /*
 **  Enable INT0
 */
 
-inline void _enable_int0(void) {
+static inline void _enable_int0(void) {
 	// Clear any pending INT0
 	GIFR |= 1<<INTF0;
 	// Enable INT0
@@ -70,7 +389,7 @@ inline void _enable_int0(void) {
 **  Disable INT0
 */
 
-inline void _disable_int0(void) {
+static inline void _disable_int0(void) {
 	GIMSK &= ~( 1<<INT0 );
 }
 
@@ -78,24 +397,27 @@ inline void _disable_int0(void) {
 **  Enable TIMER1_COMPA - TX bit timer
 */
 
-inline void _start_tx(void) {
+static inline void _start_tx(void) {
 	TIMSK |= 1<<OCIE1A;
 }
 
 /*
-**  Disable TIMER1_COMPA
+**  Disable TIMER1_COMPA, unless alarms are counting on it
 */
 
-inline void _stop_tx(void) {
-	// Enable TIMER_COMP1A
-	TIMSK &= ~( 1<<OCIE1A );
+static inline void _stop_tx(void) {
+#ifndef FDSERIAL_TICKS
+	if (! fd_uart1.alarms_set) {
+		TIMSK &= ~( 1<<OCIE1A );
+	}
+#endif
 }
 
 /*
 **  Enable TIMER1_COMPB - RX bit timer
 */
 
-inline void _start_rx(void) {
+static inline void _start_rx(void) {
 	// Clear pending RX timer interrupt
 	TIFR |= 1<<OCF1B;
 	// Enable TIMER_COMP1B
@@ -106,10 +428,50 @@ inline void _start_rx(void) {
 **  Disable TIMER1_COMPB
 */
 
-inline void _stop_rx(void) {
+static inline void _stop_rx(void) {
 	TIMSK &= ~( 1<<OCIE1B );
 }
 
+/*
+**  Raise and drop FDSERIAL_PROFILE_PIN around the Timer1 handlers
+*/
+
+static inline void _profile_start(void) {
+#ifdef FDSERIAL_PROFILE_PIN
+	PORTB |= FDSERIAL_PROFILE_PIN;
+#endif
+}
+
+static inline void _profile_end(void) {
+#ifdef FDSERIAL_PROFILE_PIN
+	PORTB &= ~( FDSERIAL_PROFILE_PIN );
+#endif
+}
+
+#ifdef SERIAL_DITHER
+/*
+**  Add one bit's excess to a dither accumulator. Return true when
+**  it carries, meaning the next bit should be a tick short.
+*/
+
+static inline uint8_t _dither(volatile uint8_t *acc) {
+	uint8_t old = *acc;
+	uint8_t sum = old + fd_uart1.dither_step;
+
+	*acc = sum;
+	return sum < old;
+}
+
+/*
+**  Return the compare value one tick before ocr. The timer has
+**  already passed it, so the next match comes a tick early.
+*/
+
+static inline uint8_t _tick_before(uint8_t ocr) {
+	return ocr ? ocr - 1 : fd_uart1.top;
+}
+#endif
+
 /*
 **  Initialise the software UART.
 **
@@ -117,7 +479,8 @@ inline void _stop_rx(void) {
 **    1 interrupts per data bit
 **    CTC mode (CTC1=1)
 **    No output pin
-**    Frequency = 8000000 / 4 / 208 = 9615 bits/sec
+**    Frequency = CPU_FREQ / PRESCALER_DIVISOR / (SERIAL_TOP + 1)
+**      e.g. 8000000 / 4 / 208 = 9615 bits/sec
 **    Prescaler = 4, Clock source = System clock, OCR1C = 207
 **  Configure INT0 so an interrupt occurs on the falling edge
 **    of INT0 (pin 7)
@@ -128,28 +491,94 @@ void fdserial_init(void) {
 	uint8_t ctc_mode = 1<<CTC1;
 
 	fd_uart1.send_ready = 1;
-	fd_uart1.tx_state = 0;
+	TX_STATE = 0;
+#ifdef FDSERIAL_ASM_TX
+	fdserial_tx_level = 1;
+#endif
+	fd_uart1.alarms_set = 0;
+#ifdef FDSERIAL_TICKS
+	fd_uart1.ticks = 0;
+	fd_uart1.ms = 0;
+	fd_uart1.ms_ticks = 0;
+	fd_uart1.ms_cycles = 0;
+#endif
 
 	fd_uart1.available = 0;
-	fd_uart1.rx_state = 0;
+	RX_STATE = 0;
+
+#ifdef FDSERIAL_AUTOBAUD
+	fd_uart1.autobaud = 0;
+	fd_uart1.rate = SERIAL_RATE;
+#endif
+
+	fd_uart1.prescaler = PRESCALER;
+	fd_uart1.top = SERIAL_TOP;
+	fd_uart1.halfbit = SERIAL_HALFBIT;
+#ifdef FDSERIAL_TICKS
+	fd_uart1.bit_cycles = SERIAL_TICKS * PRESCALER_DIVISOR;
+#endif
+#ifdef SERIAL_DITHER
+	fd_uart1.dither_step = SERIAL_DITHER_STEP;
+#endif
+
+	fd_uart1.errors = 0;
+	fd_uart1.overflows = 0;
+	fd_uart1.frame_errors = 0;
+	fd_uart1.breaks = 0;
+	fd_uart1.parity_errors = 0;
+#ifdef FDSERIAL_ADDRESS
+	fd_uart1.addr_filter = 0;
+	fd_uart1.selected = 1;
+#endif
 
 #ifdef RING_BUFFER
 	fd_uart1.rx_head = 0;
 	fd_uart1.rx_tail = 0;
 #endif
 
+#ifdef FDSERIAL_FRAMES
+	fd_uart1.frame_head = 0;
+	fd_uart1.frame_tail = 0;
+	fd_uart1.frame_bytes = 0;
+	fd_uart1.frame_bad = 0;
+#endif
+
+#ifdef FDSERIAL_DELIMITER
+	fd_uart1.lines = 0;
+#endif
+
+#ifdef TX_RING_BUFFER
+	fd_uart1.tx_head = 0;
+	fd_uart1.tx_tail = 0;
+#endif
+
 	// Configure INT0 to interrupt on falling edge
 	MCUCR |= 1<<ISC01;
 
 	TCNT1 = 0;
 	OCR1A = 16; // this will be used for send bit timing
 	OCR1B = 32; // this will be used for receive bit timing
-	OCR1C = SERIAL_TOP;
+	OCR1C = fd_uart1.top;
 
 	// Configure pin PORTB3 as an output, and raise it
 	DDRB |= S1_TX_PIN;
 	PORTB |= S1_TX_PIN;
 
+#ifdef FDSERIAL_USI_TX
+	// Timer0 in CTC mode at the bit rate clocks the USI. Three-wire
+	// mode with no clock selected leaves DO at the idle level.
+	TCCR0A = 1<<WGM01;
+	TCCR0B = USI_PRESCALER;
+	OCR0A = USI_TICKS - 1;
+	USIDR = 0xff;
+	USICR = 1<<USIWM0;
+#endif
+
+#ifdef FDSERIAL_PROFILE_PIN
+	DDRB |= FDSERIAL_PROFILE_PIN;
+	PORTB &= ~( FDSERIAL_PROFILE_PIN );
+#endif
+
 	// Configure pin PORTB2 as an input, and enable pullup
 	DDRB &= ~( S1_RX_PIN );
 	PORTB |= S1_RX_PIN;
@@ -158,6 +587,11 @@ void fdserial_init(void) {
 	TCCR1 = ctc_mode | com_mode;
 	_starttimer();
 	_enable_int0();
+#ifdef FDSERIAL_TICKS
+	// Count bit times from now on
+	_start_tx();
+#endif
+	_timer_idle();
 }
 
 /*
@@ -167,248 +601,1887 @@ void fdserial_init(void) {
 
 uint8_t fdserial_available(void) {
 #ifdef RING_BUFFER
-	char d = fd_uart1.rx_head - fd_uart1.rx_tail;
-	if (d < 0) {
-		return d + RING_BUFFER;
-	}
-
-	return d;
+	return (uint8_t) (fd_uart1.rx_head - fd_uart1.rx_tail);
 #else
 	return fd_uart1.available;
 #endif
 }
 
 /*
-**  fdserial_sendok()
-**    Return true if the transmit interface is free to transmit a character.
+**  fdserial_errors()
+**    Return the FDSERIAL_ERR_ bits raised since the last call, and
+**    clear them. Under RX_STOP, clearing FDSERIAL_ERR_OVERFLOW lets
+**    the receiver store characters again.
 */
 
-uint8_t fdserial_sendok(void) {
-	return fd_uart1.send_ready;
+uint8_t fdserial_errors(void) {
+	uint8_t sreg = SREG;
+	uint8_t errors;
+
+	cli();
+	errors = fd_uart1.errors;
+	fd_uart1.errors = 0;
+	SREG = sreg;
+
+	return errors;
 }
 
 /*
-**  fdserial_send(c)
-**    Send the character c.
+**  fdserial_overflows()
+**    Return the number of received characters lost because the
+**    caller did not read them in time. The count wraps at 65535.
 */
 
-void fdserial_send(unsigned char send_arg) {
-	// Wait until previous byte finished
-	while (! fd_uart1.send_ready) { }
+uint16_t fdserial_overflows(void) {
+	uint8_t sreg = SREG;
+	uint16_t n;
 
-	OCR1A = TCNT1;
-	fd_uart1.send_ready = 0;
-	fd_uart1.send_byte = send_arg;
-	fd_uart1.tx_state = 1; // Send start bit
-	_start_tx();
+	cli();
+	n = fd_uart1.overflows;
+	SREG = sreg;
+
+	return n;
 }
 
 /*
-**  c = fdserial_recv()
-**    Return the received character.
-**    The receive interface is buffered, so when a character is available
-**    the MCU has at most 1 character-time to receive it, otherwise it
-**    will be overwritten by the next character.
-**
-**    This function will wait until a character is received.
+**  fdserial_frame_errors()
+**    Return the number of frames dropped because the stop bit was
+**    low: a glitch, a rate mismatch or a break. The count wraps at
+**    65535.
 */
 
-unsigned char fdserial_recv() {
-	unsigned char c;
+uint16_t fdserial_frame_errors(void) {
+	uint8_t sreg = SREG;
+	uint16_t n;
 
-#ifdef RING_BUFFER
-	// Wait until chars in buffer
-	while (fd_uart1.rx_head == fd_uart1.rx_tail) { }
+	cli();
+	n = fd_uart1.frame_errors;
+	SREG = sreg;
 
-	c = fd_uart1.rx_buf[fd_uart1.rx_tail];
+	return n;
+}
 
-	// Don't use the 'mod' operation because it is expensive.
-	// Also don't ever set rx_tail = RING_BUFFER.
-	if (fd_uart1.rx_tail == RING_BUFFER - 1) {
-		fd_uart1.rx_tail = 0;
-	} else {
-		fd_uart1.rx_tail ++;
-	}
-#else
-	// Wait until available
-	while (! fd_uart1.available) { }
-	c = fd_uart1.recv_byte;
-	fd_uart1.recv_byte = 0;  // Reading nulls means you are probably doing something wrong
-	fd_uart1.available = 0;
-#endif
+/*
+**  fdserial_breaks()
+**    Return the number of breaks received. Each one also sets
+**    FDSERIAL_ERR_BREAK. The count wraps at 65535.
+*/
 
-	return c;
-}
+uint16_t fdserial_breaks(void) {
+	uint8_t sreg = SREG;
+	uint16_t n;
 
+	cli();
+	n = fd_uart1.breaks;
+	SREG = sreg;
+
+	return n;
+}
 
 /*
-**  fdserial_alarm(uint32_t duration)
-**
-**  Keep the transmit system busy for the specified number of ms.
-**
-**  Wait until the transmit state is idle, then setup the
-**  transmit bit comparator to count down.
+**  fdserial_parity_errors()
+**    Return the number of characters dropped because their parity
+**    bit was wrong. Each one also sets FDSERIAL_ERR_PARITY. The
+**    count wraps at 65535.
 */
 
-void fdserial_alarm(uint32_t duration) {
-	uint32_t timer_ticks = ( duration * CPU_FREQ ) / PRESCALER_DIVISOR / 1000;
-	uint32_t cycles = timer_ticks / ( SERIAL_TOP + 1);
-	uint8_t remainder = timer_ticks - (cycles * (SERIAL_TOP + 1));
-	// Wait until available
-	while (! fd_uart1.send_ready) { }
+uint16_t fdserial_parity_errors(void) {
+	uint8_t sreg = SREG;
+	uint16_t n;
 
-	OCR1A = TCNT1 - remainder;
-	fd_uart1.delay = cycles;
-	fd_uart1.send_ready = 0;
-	fd_uart1.tx_state = 5;
+	cli();
+	n = fd_uart1.parity_errors;
+	SREG = sreg;
+
+	return n;
 }
 
+#ifdef FDSERIAL_ADDRESS
 /*
-**  fdserial_delay(uint32_t duration)
-**
-**  Delay for the specified number of ms.
-**
-**  Setup an alarm for the specified duration, then
-**  spin until the alarm has expired (transmit state
-**  has returned to idle).
+**  fdserial_set_address(addr)
+**    Drop received characters until an address byte (bit 8 set)
+**    equal to 0x100 | addr arrives. That byte and the data after
+**    it are received, up to the next address byte for another node.
 */
 
-void fdserial_delay(uint32_t duration) {
-	fdserial_alarm(duration);
+void fdserial_set_address(uint8_t addr) {
+	uint8_t sreg = SREG;
 
-	// Wait until alarm expires
-	while (! fd_uart1.send_ready) { }
+	cli();
+	fd_uart1.address = addr;
+	fd_uart1.addr_filter = 1;
+	fd_uart1.selected = 0;
+	SREG = sreg;
 }
 
 /*
-** Interrupt handler for timer1, TCCR1A, tx bits
+**  fdserial_clear_address()
+**    Receive every character, addressed to this node or not.
 */
 
-ISR(TIMER1_COMPA_vect)
-{
-	switch(fd_uart1.tx_state) {
-		case 0: // Idle
-			return;
-
-		case 1: // Send start bit
-			PORTB &= ~( S1_TX_PIN );
-			fd_uart1.tx_state = 2;
-			fd_uart1.send_bits = 8;
-			return;
-
-		case 2: // Send a bit
-			if (fd_uart1.send_byte & 1) {
-				PORTB |= S1_TX_PIN;
-			} else {
-				PORTB &= ~( S1_TX_PIN );
-			}
-			fd_uart1.send_byte >>= 1;
+void fdserial_clear_address(void) {
+	uint8_t sreg = SREG;
 
-			if (! --fd_uart1.send_bits) {
-				fd_uart1.tx_state = 3;
-			}
-			return;
-
-		case 3: // Send stop bit
-			PORTB |= S1_TX_PIN;
-			fd_uart1.tx_state = 4;
-			return;
-
-		case 4: // Return to idle mode
-			fd_uart1.send_ready = 1;
-			fd_uart1.tx_state = 0;
-			_stop_tx();
-			return;
-		case 5: // Timed delay
-			if (! --fd_uart1.delay) {
-				fd_uart1.send_ready = 1;
-				fd_uart1.tx_state = 0;
-			}
-			return;
-	}
+	cli();
+	fd_uart1.addr_filter = 0;
+	fd_uart1.selected = 1;
+	SREG = sreg;
 }
+#endif
 
+#if FRAME_PARITY_BITS
 /*
-** Interrupt handler for timer1, TCCR1B, rx bits
+**  Return the parity bit for character c
 */
 
-ISR(TIMER1_COMPB_vect)
-{
-	// Read the bit as early as possible, to try to hit the
-	// center mark
-	uint8_t read_bit = PINB & S1_RX_PIN;
+static inline uint8_t _parity_bit(fd_char_t c) {
+	uint8_t p = parity_even_bit((uint8_t) c & (0xff >> (8 - FRAME_DATA8)));
 
-	switch(fd_uart1.rx_state) {
-		case 0: // Midpoint of start bit. Go on to first data bit.
-			fd_uart1.rx_state = 2;
-			fd_uart1.recv_bits = 8;
-			break;
+#if SERIAL_DATA_BITS > 8
+	p ^= (c >> 8) & 1;
+#endif
+#if SERIAL_PARITY == SERIAL_PARITY_ODD
+	p ^= 1;
+#endif
 
-		case 1: // Reading start bit
-			// Go straight on to first data bit
-			fd_uart1.rx_state = 2;
-			fd_uart1.recv_bits = 8;
-			break;
+	return p;
+}
+#endif
 
-		case 2: // Reading a data bit
-			fd_uart1.recv_shift >>= 1;
-			if (read_bit) {
-				fd_uart1.recv_shift |= 0x80;
-			}
+#if FRAME_TAIL_BITS > 1
+/*
+**  Return the bits to send after the first 8 data bits of c, in
+**  order from bit 0: the 9th data bit, parity, then stop bits.
+*/
 
-			if (! --fd_uart1.recv_bits) {
-				fd_uart1.rx_state = 3;
-			}
-			break;
+static inline uint8_t _frame_tail(fd_char_t c) {
+	uint8_t tail = (uint8_t) (0xff << FRAME_EXTRA_BITS);
 
-		case 3: // Byte done, wait for high
-			if (read_bit) {
-#ifdef RING_BUFFER
-				// Put the latest char in the buffer
-				fd_uart1.rx_buf[fd_uart1.rx_head] = fd_uart1.recv_shift;
-
-				// Increment the buffer head
-				if (fd_uart1.rx_head == RING_BUFFER - 1) {
-					fd_uart1.rx_head = 0;
-				} else {
-					fd_uart1.rx_head ++;
-				}
-
-				// If buffer is full,
-				if (fd_uart1.rx_head == fd_uart1.rx_tail) {
-					// Increment rx_tail to drop oldest character
-					if (fd_uart1.rx_tail == RING_BUFFER - 1) {
-						fd_uart1.rx_tail = 0;
-					} else {
-						fd_uart1.rx_tail ++;
-					}
-				}
+#if SERIAL_DATA_BITS > 8
+	tail |= (c >> 8) & 1;
+#endif
+#if FRAME_PARITY_BITS
+	tail |= _parity_bit(c) << (SERIAL_DATA_BITS - FRAME_DATA8);
+#endif
+
+	return tail;
+}
+#endif
+
+/*
+**  fdserial_sendok()
+**    Return true if the transmit interface can take a character
+**    without waiting.
+*/
+
+uint8_t fdserial_sendok(void) {
+#ifdef TX_RING_BUFFER
+	return (uint8_t) (fd_uart1.tx_head - fd_uart1.tx_tail) != TX_RING_BUFFER;
 #else
-				fd_uart1.recv_byte = fd_uart1.recv_shift;
-				fd_uart1.available = 1;
+	return fd_uart1.send_ready;
 #endif
-				fd_uart1.rx_state = 0;
-				_stop_rx();
-				_enable_int0();
-			}
-			break;
-	}
 }
 
+#ifdef FDSERIAL_USI_TX
 /*
-** This is called on the falling edge of INT0 (pin 7).
-** It is the beginning of a start bit.
+**  Reverse the bits of b, for the USI which shifts out MSB first
 */
 
-ISR(INT0_vect) {
-	uint8_t tcnt1 = TCNT1;
+static inline uint8_t _reverse(uint8_t b) {
+	b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+	b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+	b = (b & 0xaa) >> 1 | (b & 0x55) << 1;
 
-	// Set sample time, half a bit after now.
-	if (tcnt1 >= SERIAL_HALFBIT) {
-		OCR1B = tcnt1 - SERIAL_HALFBIT;
-	} else {
-		OCR1B = tcnt1 + SERIAL_HALFBIT;
-	}
+	return b;
+}
+
+/*
+**  Load the next queued character into the USI. The whole frame,
+**  start bit first, is built in a 16-bit word padded with idle 1s.
+**  Bits 0-7 go in now, and the overflow comes after 7 shifts with
+**  bit 7 on DO. The second load, bits 7-14 kept in send_byte, then
+**  starts with the bit already showing, so DO does not glitch.
+*/
+
+static void _usi_load(void) {
+	fd_char_t c = fd_uart1.tx_buf[fd_uart1.tx_tail & TX_MASK];
+	uint16_t frame;
+
+	fd_uart1.tx_tail ++;
+
+	frame = (uint16_t) ((uint8_t) c & (0xff >> (8 - FRAME_DATA8))) << 1;
+#if FRAME_TAIL_BITS > 1
+	frame |= (uint16_t) _frame_tail(c) << (1 + FRAME_DATA8);
+#else
+	frame |= (uint16_t) 0xff << (1 + FRAME_DATA8);
+#endif
+#if FRAME_DATA8 < 6
+	frame |= (uint16_t) 0xffff << (9 + FRAME_DATA8);
+#endif
+
+	USIDR = _reverse(frame);
+	USISR = 1<<USIOIF | (16 - 7);
+	SEND_BYTE = _reverse(frame >> 7);
+	TX_STATE = 1;
+}
+
+/*
+**  Start sending from idle. Timer0 is restarted one tick before
+**  zero so the start bit, which begins when USIDR is written, gets
+**  a whole bit time.
+*/
+
+static void _begin_tx(void) {
+	fd_uart1.send_ready = 0;
+	GTCCR |= 1<<PSR0;
+	TCNT0 = 0xff;
+	_usi_load();
+	USICR = 1<<USIOIE | 1<<USIWM0 | 1<<USICS0;
+}
+#else
+/*
+**  Start sending from idle. The first compare match comes one bit
+**  time from now and sends the start bit, or if alarms are running,
+**  the next one, so as not to upset their count.
+*/
+
+static void _begin_tx(void) {
+	if (! (TIMSK & 1<<OCIE1A)) {
+		OCR1A = TCNT1;
+	}
+	fd_uart1.send_ready = 0;
+	_wake_timer();
+	TX_STATE = 1; // Send start bit
+	_start_tx();
+}
+#endif
+
+/*
+**  fdserial_send(c)
+**    Send the character c.
+**    With TX_RING_BUFFER, the character is queued and this returns
+**    at once unless the buffer is full.
+*/
+
+void fdserial_send(fd_char_t send_arg) {
+#ifdef TX_RING_BUFFER
+	uint8_t head = fd_uart1.tx_head;
+	uint8_t sreg;
+
+	// Wait until there is room in the buffer
+	_wait_until((uint8_t) (head - fd_uart1.tx_tail) != TX_RING_BUFFER);
+
+	fd_uart1.tx_buf[head & TX_MASK] = send_arg;
+	fd_uart1.tx_head = head + 1;
+
+	// The ISR may go idle at any moment, so check
+	// and restart it with interrupts off.
+	sreg = SREG;
+	cli();
+	if (fd_uart1.send_ready) {
+		_begin_tx();
+	}
+	SREG = sreg;
+#else
+	// Wait until previous byte finished
+	_wait_until(fd_uart1.send_ready);
+
+	SEND_BYTE = send_arg;
+#if FRAME_TAIL_BITS > 1
+	fd_uart1.send_tail = _frame_tail(send_arg);
+#endif
+	_begin_tx();
+#endif
+}
+
+#ifdef FDSERIAL_DELIMITER
+/*
+**  Count n delimiters taken from the rx buffer by the lock-free
+**  copy. The RX interrupt also changes the count, so with
+**  interrupts off.
+*/
+
+static inline void _lines_taken(uint8_t n) {
+	uint8_t sreg = SREG;
+
+	cli();
+	fd_uart1.lines -= n;
+	SREG = sreg;
+}
+#endif
+
+#ifdef RING_BUFFER
+/*
+**  Take the oldest character from the rx buffer, which must not be
+**  empty. Under RX_DROP_OLDEST the RX interrupt also moves rx_tail
+**  when the buffer is full, and stores into the slot it frees, so
+**  the read and the move are made with interrupts off. So is the
+**  line count with FDSERIAL_DELIMITER, which the interrupt changes
+**  too, together with the tail: a delimiter is counted off either
+**  here or by the interrupt dropping it, never both.
+*/
+
+static inline fd_char_t _rx_take(void) {
+	fd_char_t c;
+#if RX_OVERFLOW == RX_DROP_OLDEST || defined(FDSERIAL_DELIMITER)
+	uint8_t sreg = SREG;
+
+	cli();
+#endif
+	c = fd_uart1.rx_buf[fd_uart1.rx_tail & RX_MASK];
+	fd_uart1.rx_tail ++;
+#ifdef FDSERIAL_DELIMITER
+	if (c == FDSERIAL_DELIMITER) {
+		fd_uart1.lines --;
+	}
+#endif
+#if RX_OVERFLOW == RX_DROP_OLDEST || defined(FDSERIAL_DELIMITER)
+	SREG = sreg;
+#endif
+
+	return c;
+}
+#endif
+
+/*
+**  c = fdserial_recv()
+**    Return the received character.
+**    The receive interface is buffered, so when a character is available
+**    the MCU has at most 1 character-time to receive it, otherwise it
+**    will be overwritten by the next character.
+**
+**    This function will wait until a character is received.
+*/
+
+fd_char_t fdserial_recv() {
+	fd_char_t c;
+
+#ifdef RING_BUFFER
+	// Wait until chars in buffer
+	_wait_until(fd_uart1.rx_head != fd_uart1.rx_tail);
+
+	c = _rx_take();
+#else
+	// Wait until available
+	_wait_until(fd_uart1.available);
+	c = fd_uart1.recv_byte;
+	fd_uart1.recv_byte = 0;  // Reading nulls means you are probably doing something wrong
+	fd_uart1.available = 0;
+#endif
+
+	return c;
+}
+
+
+/*
+**  n = fdserial_trywrite(buf, len)
+**    Queue as many of the len bytes at buf as will fit, and return
+**    how many were queued. Never waits.
+**
+**    Only this side of the ring moves tx_head, so the bytes are
+**    copied with interrupts enabled; the critical section covers
+**    just publishing the new head and starting an idle transmitter.
+*/
+
+uint8_t fdserial_trywrite(const fd_char_t *buf, uint8_t len) {
+#ifdef TX_RING_BUFFER
+	uint8_t head = fd_uart1.tx_head;
+	uint8_t room = TX_RING_BUFFER - (uint8_t) (head - fd_uart1.tx_tail);
+	uint8_t n = 0;
+	uint8_t sreg;
+
+	while (n < len && n < room) {
+		fd_uart1.tx_buf[head++ & TX_MASK] = buf[n++];
+	}
+
+	if (n) {
+		sreg = SREG;
+		cli();
+		fd_uart1.tx_head = head;
+		if (fd_uart1.send_ready) {
+			_begin_tx();
+		}
+		SREG = sreg;
+	}
+
+	return n;
+#else
+	uint8_t n = 0;
+
+	while (n < len && fd_uart1.send_ready) {
+		fdserial_send(buf[n++]);
+	}
+
+	return n;
+#endif
+}
+
+/*
+**  n = fdserial_write(buf, len)
+**    Send the len bytes at buf, waiting whenever the transmit
+**    buffer is full. Returns len.
+*/
+
+uint8_t fdserial_write(const fd_char_t *buf, uint8_t len) {
+	uint8_t n = 0;
+
+	while (n < len) {
+		n += fdserial_trywrite(buf + n, len - n);
+		if (n < len) {
+			_wait_until(fdserial_sendok());
+		}
+	}
+
+	return n;
+}
+
+/*
+**  n = fdserial_tryread(buf, len)
+**    Copy up to len received bytes into buf, and return how many
+**    were copied. Never waits.
+**
+**    Unless RX_OVERFLOW is RX_DROP_OLDEST, only this side of the ring
+**    moves rx_tail, so the copy needs no critical section: head is
+**    read once and tail written once. Under RX_DROP_OLDEST the RX
+**    interrupt moves it too, and each byte is taken with interrupts
+**    off; a single critical section over the whole copy could hold
+**    off the RX interrupt for more than a bit time.
+*/
+
+uint8_t fdserial_tryread(fd_char_t *buf, uint8_t len) {
+	uint8_t n = 0;
+
+#ifdef RING_BUFFER
+#if RX_OVERFLOW == RX_DROP_OLDEST
+	// The interrupt only drops from a full ring, so it never empties
+	while (n < len && fd_uart1.rx_head != fd_uart1.rx_tail) {
+		buf[n++] = _rx_take();
+	}
+#else
+	uint8_t head = fd_uart1.rx_head;
+	uint8_t tail = fd_uart1.rx_tail;
+#ifdef FDSERIAL_DELIMITER
+	uint8_t lines = 0;
+#endif
+
+	while (n < len && tail != head) {
+		buf[n] = fd_uart1.rx_buf[tail++ & RX_MASK];
+#ifdef FDSERIAL_DELIMITER
+		if (buf[n] == FDSERIAL_DELIMITER) {
+			lines ++;
+		}
+#endif
+		n ++;
+	}
+
+	fd_uart1.rx_tail = tail;
+#ifdef FDSERIAL_DELIMITER
+	if (lines) {
+		_lines_taken(lines);
+	}
+#endif
+#endif
+#else
+	if (len && fd_uart1.available) {
+		buf[n++] = fdserial_recv();
+	}
+#endif
+
+	return n;
+}
+
+/*
+**  n = fdserial_read(buf, len)
+**    Receive len bytes into buf, waiting until they have all
+**    arrived. Returns len.
+*/
+
+uint8_t fdserial_read(fd_char_t *buf, uint8_t len) {
+	uint8_t n = 0;
+
+	while (n < len) {
+		n += fdserial_tryread(buf + n, len - n);
+		if (n < len) {
+			_wait_until(fdserial_available());
+		}
+	}
+
+	return n;
+}
+
+#ifdef FDSERIAL_FRAMES
+/*
+**  fdserial_frames()
+**    Return the number of whole frames received and not yet read.
+*/
+
+uint8_t fdserial_frames(void) {
+	return (uint8_t) (fd_uart1.frame_head - fd_uart1.frame_tail);
+}
+
+/*
+**  n = fdserial_get_frame(buf, len)
+**    Wait for a whole frame and take it from the buffer, copying up
+**    to len bytes into buf. Return the frame's length; any bytes
+**    past len are thrown away. The frame arriving behind it is only
+**    ever added to or dropped from the head of the buffer.
+*/
+
+uint8_t fdserial_get_frame(fd_char_t *buf, uint8_t len) {
+	uint8_t tail;
+	uint8_t bytes;
+	uint8_t n;
+
+	_wait_until(fdserial_frames());
+
+	tail = fd_uart1.frame_tail;
+	bytes = fd_uart1.frame_len[tail & FRAME_MASK];
+
+	for (n = 0; n < bytes; ++n) {
+		if (n < len) {
+			buf[n] = fd_uart1.rx_buf[fd_uart1.rx_tail & RX_MASK];
+		}
+		fd_uart1.rx_tail ++;
+	}
+
+	fd_uart1.frame_tail = tail + 1;
+	return bytes;
+}
+#endif
+
+#ifdef FDSERIAL_DELIMITER
+/*
+**  fdserial_lines()
+**    Return the number of whole lines, each ended by
+**    FDSERIAL_DELIMITER, received and not yet read.
+*/
+
+uint8_t fdserial_lines(void) {
+	return fd_uart1.lines;
+}
+
+/*
+**  n = fdserial_readline(buf, len)
+**    Wait for a whole line and copy it into buf, up to and including
+**    the delimiter, and return its length. A line longer than len is
+**    cut at len and the rest left for the next call. A full buffer
+**    with no delimiter in it is returned as it is, since the rest of
+**    that line cannot be stored.
+*/
+
+uint8_t fdserial_readline(fd_char_t *buf, uint8_t len) {
+	uint8_t n = 0;
+	fd_char_t c;
+
+	_wait_until(fd_uart1.lines || fdserial_available() == RING_BUFFER);
+
+	while (n < len && fdserial_available()) {
+		c = fdserial_recv();
+		buf[n++] = c;
+		if (c == FDSERIAL_DELIMITER) {
+			break;
+		}
+	}
+
+	return n;
+}
+#endif
+
+// CPU cycles per ms
+#define MS_CYCLES (CPU_FREQ / 1000)
+
+#ifdef FDSERIAL_TICKS
+/*
+**  Return the ms since fdserial_init(), modulo 2^32, and the CPU
+**  cycles since the last whole one in *cycles. TIMER1_COMPA adds
+**  bit_cycles ms to fd_uart1.ms every MS_CYCLES bit times; the bit
+**  times since then are counted here.
+*/
+
+static uint32_t _clock(uint16_t *cycles) {
+	uint8_t sreg = SREG;
+	uint32_t ms;
+	uint32_t part;
+
+	cli();
+	ms = fd_uart1.ms;
+	part = (uint32_t) fd_uart1.ms_ticks * fd_uart1.bit_cycles + fd_uart1.ms_cycles;
+	SREG = sreg;
+
+	*cycles = part % MS_CYCLES;
+	return ms + part / MS_CYCLES;
+}
+#endif
+
+/*
+**  Program Timer1 for rate. Call with interrupts off and the line
+**  idle. Return false, changing nothing, if rate cannot be reached
+**  within SERIAL_MAX_ERROR at CPU_FREQ.
+*/
+
+static uint8_t _set_timing(uint32_t rate) {
+	uint8_t cs;
+	uint32_t div_rate = rate;
+	uint16_t ticks = 0;
+
+	if (! rate || CPU_FREQ / rate < SERIAL_MIN_CYCLES) {
+		return 0;
+	}
+
+	// Smallest prescaler, CK/1 to CK/64, which fits a bit in 256 ticks
+	for (cs = 1; cs <= 7; ++cs, div_rate <<= 1) {
+		ticks = (CPU_FREQ + div_rate - 1) / div_rate;
+		if (ticks <= 256) {
+			break;
+		}
+	}
+
+	if (cs > 7) {
+		return 0;
+	}
+
+#ifndef SERIAL_DITHER
+	{
+		uint32_t actual;
+		uint32_t error;
+
+		ticks = (CPU_FREQ + div_rate / 2) / div_rate;
+		actual = (CPU_FREQ >> (cs - 1)) / ticks;
+		error = actual > rate ? actual - rate : rate - actual;
+
+		if (error * 1000 / rate > SERIAL_MAX_ERROR) {
+			return 0;
+		}
+	}
+#endif
+
+#ifdef FDSERIAL_USI_TX
+	// Timer0 for the USI: CK/1, CK/8 or CK/64, never dithered
+	{
+		uint8_t cs0;
+		uint16_t ticks0 = 0;
+		uint32_t actual;
+		uint32_t error;
+
+		for (cs0 = 1; cs0 <= 3; ++cs0) {
+			ticks0 = ((CPU_FREQ >> (3 * (cs0 - 1))) + rate / 2) / rate;
+			if (ticks0 <= 256) {
+				break;
+			}
+		}
+
+		if (cs0 > 3) {
+			return 0;
+		}
+
+		actual = (CPU_FREQ >> (3 * (cs0 - 1))) / ticks0;
+		error = actual > rate ? actual - rate : rate - actual;
+
+		if (error * 1000 / rate > SERIAL_MAX_ERROR) {
+			return 0;
+		}
+
+		TCCR0B = cs0;
+		OCR0A = ticks0 - 1;
+	}
+#endif
+
+	_stoptimer();
+
+#ifdef FDSERIAL_TICKS
+	// Count the time so far at the old rate, so that millis and
+	// micros carry on from it at the new one
+	{
+		uint16_t cycles;
+
+		fd_uart1.ms = _clock(&cycles);
+		fd_uart1.ms_ticks = 0;
+		fd_uart1.ms_cycles = cycles;
+	}
+#endif
+
+	fd_uart1.prescaler = cs;
+	fd_uart1.top = ticks - 1;
+	fd_uart1.halfbit = ticks / 2;
+#ifdef FDSERIAL_TICKS
+	fd_uart1.bit_cycles = ticks << (cs - 1);
+#endif
+#ifdef SERIAL_DITHER
+	fd_uart1.dither_step = ((ticks * div_rate - CPU_FREQ) << 8) / div_rate;
+#endif
+
+	TCNT1 = 0;
+	OCR1A = 0;
+	OCR1B = 0;
+	OCR1C = fd_uart1.top;
+	GTCCR |= 1<<PSR1;
+
+	_starttimer();
+
+#ifdef FDSERIAL_AUTOBAUD
+	fd_uart1.rate = rate;
+#endif
+	return 1;
+}
+
+/*
+**  Wait until the line is idle: all queued bytes sent and the
+**  receiver waiting for a start bit. Returns with interrupts off
+**  and the previous SREG.
+*/
+
+static uint8_t _wait_idle(void) {
+	uint8_t sreg;
+
+	// Wait for the transmitter to finish
+	_wait_until(fd_uart1.send_ready);
+
+	// Wait for the receiver to be between frames
+	while (1) {
+		sreg = SREG;
+		cli();
+		if (GIMSK & 1<<INT0) {
+			return sreg;
+		}
+		_idle(sreg);
+	}
+}
+
+/*
+**  fdserial_set_rate(rate)
+**    Change the bit rate. Return false, changing nothing, if rate
+**    cannot be reached within SERIAL_MAX_ERROR at CPU_FREQ.
+**
+**    Waits for a frame boundary: all queued bytes sent at the old
+**    rate and the receiver waiting for a start bit. Bytes already
+**    received stay in the buffer.
+*/
+
+uint8_t fdserial_set_rate(uint32_t rate) {
+	uint8_t sreg = _wait_idle();
+	uint8_t ok = _set_timing(rate);
+
+	_timer_idle();
+	SREG = sreg;
+	return ok;
+}
+
+#ifdef FDSERIAL_POWER_DOWN
+/*
+**  fdserial_powerdown()
+**    Sleep until the next interrupt: in power-down mode if the line
+**    is idle, with all queued bytes sent, no alarm set and the
+**    receiver waiting for a start bit on a high RX pin, otherwise in
+**    idle mode. Call it in a loop, with the work to do between calls.
+**    Returns at once if a byte has been received.
+**
+**    Only a low level on INT0, not an edge, can wake the ATtiny85
+**    from power-down, so INT0 senses the level while asleep. The INT0
+**    handler switches back to the falling edge, and takes the clock
+**    start-up time, FDSERIAL_WAKEUP_CYCLES, off the first half bit.
+*/
+
+void fdserial_powerdown(void) {
+	uint8_t sreg = SREG;
+	uint8_t wake;
+
+	cli();
+	if (fdserial_available()) {
+		SREG = sreg;
+		return;
+	}
+
+	// A low RX pin would wake it at once and be taken for a start
+	// bit: the end of a break, or a stuck line
+	if (! fd_uart1.send_ready || fd_uart1.alarms_set || ! (GIMSK & 1<<INT0)
+		|| ! (PINB & S1_RX_PIN)
+#ifdef FDSERIAL_FRAMES
+		|| RX_STATE == RX_GAP
+#endif
+#ifdef FDSERIAL_AUTOBAUD
+		|| fd_uart1.autobaud
+#endif
+		) {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		SREG = sreg;
+		return;
+	}
+
+	// At least one tick must be left before the first sample
+	wake = FDSERIAL_WAKEUP_CYCLES >> (fd_uart1.prescaler - 1);
+	if (wake >= fd_uart1.halfbit) {
+		wake = fd_uart1.halfbit - 1;
+	}
+	fd_uart1.wake_ticks = wake;
+
+	_timer_idle();
+	MCUCR &= ~( 1<<ISC01 | 1<<ISC00 );
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+
+	// Woken by something other than INT0: back to the falling edge
+	cli();
+	if (! (MCUCR & ( 1<<ISC01 | 1<<ISC00 ))) {
+		MCUCR |= 1<<ISC01;
+	}
+	SREG = sreg;
+}
+#endif
+
+#ifdef FDSERIAL_AUTOBAUD
+/*
+**  Standard rates autobaud can lock onto, in multiples of 1200
+*/
+
+static const uint8_t autobaud_rates[] = { 1, 2, 4, 8, 12, 16, 24, 32, 48, 96 };
+
+#define AUTOBAUD_WAIT  1     // Waiting for a start bit
+#define AUTOBAUD_PULSE 2     // Timing the first pulse
+#define AUTOBAUD_DONE  11    // Timed 9 pulses: start bit and 8 data bits
+
+/*
+**  fdserial_autobaud_start()
+**    Wait for the line to go idle, then time the bits of the next
+**    sync character, 'U' (0x55), in the background. Its start bit
+**    and data bits alternate, so every pulse between edges is one
+**    bit long. Nothing is received until the rate is locked.
+**
+**    Timer1 runs free through all 256 counts, prescaled so that a
+**    bit at AUTOBAUD_MIN_RATE still fits, and INT0 fires on both
+**    edges. Alarms count bit times, so any running are left to
+**    expire first, and none should be set until the rate is locked.
+*/
+
+void fdserial_autobaud_start(void) {
+	uint8_t sreg;
+	uint8_t cs = 1;
+
+	while (1) {
+		sreg = _wait_idle();
+		if (! fd_uart1.alarms_set) {
+			break;
+		}
+		_idle(sreg);
+	}
+
+	while (((CPU_FREQ / AUTOBAUD_MIN_RATE) >> (cs - 1)) > 0xff) {
+		cs ++;
+	}
+
+	_stoptimer();
+	fd_uart1.prescaler = cs;
+	TCNT1 = 0;
+	OCR1C = 0xff;
+	_starttimer();
+
+	// INT0 on any logical change
+	MCUCR = (MCUCR & ~( 1<<ISC01 )) | 1<<ISC00;
+
+	fd_uart1.autobaud = AUTOBAUD_WAIT;
+	_enable_int0();
+
+	SREG = sreg;
+}
+
+/*
+**  fdserial_autobaud_rate()
+**    Return 0 while waiting for the sync character. Once it has
+**    been timed, switch to the nearest standard rate, resume
+**    receiving and return that rate. A rate too fast for CPU_FREQ
+**    leaves the one in use before, which is returned instead.
+*/
+
+uint32_t fdserial_autobaud_rate(void) {
+	uint32_t measured;
+	uint32_t rate;
+	uint8_t i;
+	uint8_t sreg;
+
+	if (fd_uart1.autobaud != AUTOBAUD_DONE) {
+		return 0;
+	}
+
+	measured = (CPU_FREQ >> (fd_uart1.prescaler - 1)) * 9 / fd_uart1.ab_span;
+
+	// Nearest standard rate; choose the higher one above the midpoint
+	for (i = 0; i < sizeof(autobaud_rates) - 1; ++i) {
+		if (measured * 2 < 1200UL * (autobaud_rates[i] + autobaud_rates[i + 1])) {
+			break;
+		}
+	}
+
+	rate = 1200UL * autobaud_rates[i];
+
+	sreg = SREG;
+	cli();
+
+	if (! _set_timing(rate)) {
+		// Too fast for CPU_FREQ; back to the previous rate
+		rate = fd_uart1.rate;
+		_set_timing(rate);
+	}
+
+	// Back to start bit detection on the falling edge
+	MCUCR = (MCUCR & ~( 1<<ISC00 )) | 1<<ISC01;
+	fd_uart1.autobaud = 0;
+	_enable_int0();
+	_timer_idle();
+
+	SREG = sreg;
+	return rate;
+}
+
+/*
+**  fdserial_autobaud()
+**    Wait for a sync character, lock onto its rate and return it.
+*/
+
+uint32_t fdserial_autobaud(void) {
+	uint32_t rate;
+
+	fdserial_autobaud_start();
+
+	_wait_until(fd_uart1.autobaud == AUTOBAUD_DONE);
+	rate = fdserial_autobaud_rate();
+
+	return rate;
+}
+
+/*
+**  Time one edge of the sync character. Called from INT0_vect.
+*/
+
+static inline void _autobaud_edge(uint8_t tcnt1) {
+	uint8_t width = tcnt1 - fd_uart1.ab_last;
+
+	fd_uart1.ab_last = tcnt1;
+
+	if (fd_uart1.autobaud == AUTOBAUD_WAIT) {
+		if (! (PINB & S1_RX_PIN)) {
+			// Falling edge: start bit
+			fd_uart1.autobaud = AUTOBAUD_PULSE;
+			fd_uart1.ab_span = 0;
+			fd_uart1.ab_min = 0xff;
+			fd_uart1.ab_max = 0;
+		}
+		return;
+	}
+
+	fd_uart1.ab_span += width;
+	if (width < fd_uart1.ab_min) {
+		fd_uart1.ab_min = width;
+	}
+	if (width > fd_uart1.ab_max) {
+		fd_uart1.ab_max = width;
+	}
+
+	if (++fd_uart1.autobaud == AUTOBAUD_DONE) {
+		// All pulses the same length, and now in the stop bit?
+		if (fd_uart1.ab_max <= fd_uart1.ab_min + fd_uart1.ab_min / 2
+			&& (PINB & S1_RX_PIN)) {
+			_disable_int0();
+		} else {
+			// Not a 'U', try the next character
+			fd_uart1.autobaud = AUTOBAUD_WAIT;
+		}
+	}
+}
+#endif
+
+// Longest alarm, in bit times: alarm_ticks is compared as signed
+#define ALARM_MAX 0x7fff
+
+/*
+**  Return true if the alarm has expired, or was never set. Called
+**  with interrupts off.
+*/
+
+static uint8_t _alarm_expired(uint8_t alarm) {
+	return ! (fd_uart1.alarms_set & 1<<alarm)
+		|| (int16_t) (fd_uart1.alarm_ticks - fd_uart1.alarm_end[alarm]) >= 0;
+}
+
+/*
+**  Return the first alarm not running, or FDSERIAL_ALARMS if all are.
+*/
+
+static uint8_t _free_alarm(void) {
+	uint8_t sreg = SREG;
+	uint8_t alarm;
+
+	cli();
+	for (alarm = 0; alarm < FDSERIAL_ALARMS; ++alarm) {
+		if (_alarm_expired(alarm)) {
+			break;
+		}
+	}
+	SREG = sreg;
+	return alarm;
+}
+
+/*
+**  Count bit times for the alarms. Called from TIMER1_COMPA_vect
+**  while any are running, and once they have all expired, let the
+**  interrupt be turned off.
+*/
+
+static inline void _tick_alarms(uint8_t ticks) {
+	uint16_t now = fd_uart1.alarm_ticks + ticks;
+
+	fd_uart1.alarm_ticks = now;
+	if ((int16_t) (now - fd_uart1.alarm_stop) >= 0) {
+		fd_uart1.alarms_set = 0;
+	}
+}
+
+/*
+**  CPU cycles per bit time, at most 256 timer ticks of 64 cycles
+*/
+
+static uint16_t _tick_cycles(void) {
+	return (uint16_t) (fd_uart1.top + 1) << (fd_uart1.prescaler - 1);
+}
+
+/*
+**  fdserial_ms_to_ticks(ms)
+**    Return the bit times in ms, rounded up. Each product is split
+**    in two so as not to overflow 32 bits.
+*/
+
+uint32_t fdserial_ms_to_ticks(uint32_t ms) {
+	uint16_t cycles = _tick_cycles();
+
+	return ( ms / cycles ) * MS_CYCLES
+		+ ( ( ms % cycles ) * MS_CYCLES + cycles - 1 ) / cycles;
+}
+
+/*
+**  fdserial_ticks_to_ms(ticks)
+**    Return the ms in a number of bit times, rounded down.
+*/
+
+uint32_t fdserial_ticks_to_ms(uint32_t ticks) {
+	uint16_t cycles = _tick_cycles();
+
+	return ( ticks / MS_CYCLES ) * cycles
+		+ ( ticks % MS_CYCLES ) * cycles / MS_CYCLES;
+}
+
+/*
+**  fdserial_ticks_to_us(ticks)
+**    Return the us in a number of bit times, rounded down, modulo
+**    2^32. The whole ms and the fraction left over are worked out
+**    as in fdserial_ticks_to_ms().
+*/
+
+uint32_t fdserial_ticks_to_us(uint32_t ticks) {
+	uint16_t cycles = _tick_cycles();
+	uint32_t part = ( ticks % MS_CYCLES ) * cycles;
+	uint32_t ms = ( ticks / MS_CYCLES ) * cycles + part / MS_CYCLES;
+
+	return ms * 1000 + ( part % MS_CYCLES ) * 1000 / MS_CYCLES;
+}
+
+#ifdef FDSERIAL_TICKS
+/*
+**  fdserial_ticks()
+**    Return the bit times since fdserial_init().
+*/
+
+uint32_t fdserial_ticks(void) {
+	uint8_t sreg = SREG;
+	uint32_t ticks;
+
+	cli();
+	ticks = fd_uart1.ticks;
+	SREG = sreg;
+	return ticks;
+}
+
+/*
+**  fdserial_millis()
+**    Return the ms since fdserial_init(), modulo 2^32.
+*/
+
+uint32_t fdserial_millis(void) {
+	uint16_t cycles;
+
+	return _clock(&cycles);
+}
+
+/*
+**  fdserial_micros()
+**    Return the us since fdserial_init(), modulo 2^32.
+*/
+
+uint32_t fdserial_micros(void) {
+	uint16_t cycles;
+	uint32_t ms = _clock(&cycles);
+
+	return ms * 1000 + (uint32_t) cycles * 1000 / MS_CYCLES;
+}
+#endif
+
+/*
+**  fdserial_alarm(uint32_t duration)
+**
+**  Set an alarm for the specified number of ms, and return its
+**  number for fdserial_alarm_expired().
+*/
+
+uint8_t fdserial_alarm(uint32_t duration) {
+	return fdserial_alarm_ticks(fdserial_ms_to_ticks(duration));
+}
+
+/*
+**  fdserial_alarm_ticks(uint32_t bits)
+**
+**  Set an alarm for the specified number of bit times.
+**
+**  Alarms count whole bit times on TIMER1_COMPA, which runs for
+**  as long as any alarm does, and end up to a bit time late.
+**  Sending carries on meanwhile. If all FDSERIAL_ALARMS are
+**  running, wait for one to expire.
+*/
+
+uint8_t fdserial_alarm_ticks(uint32_t bits) {
+	uint16_t end;
+	uint8_t alarm;
+	uint8_t sreg;
+
+	// Plus the bit time already started
+	if (bits >= ALARM_MAX) {
+		bits = ALARM_MAX - 1;
+	}
+	bits ++;
+
+	// Wait until one is available
+	_wait_until((alarm = _free_alarm()) < FDSERIAL_ALARMS);
+
+	sreg = SREG;
+	cli();
+	end = fd_uart1.alarm_ticks + bits;
+	fd_uart1.alarm_end[alarm] = end;
+	if (! fd_uart1.alarms_set || (int16_t) (end - fd_uart1.alarm_stop) > 0) {
+		fd_uart1.alarm_stop = end;
+	}
+	fd_uart1.alarms_set |= 1<<alarm;
+	_wake_timer();
+	_start_tx();
+	SREG = sreg;
+
+	return alarm;
+}
+
+/*
+**  Set an alarm for as much of bits as one alarm can time, and take
+**  that from bits. Waits that may be longer go round again until
+**  bits is 0.
+*/
+
+static uint8_t _alarm_part(uint32_t *bits) {
+	uint16_t part = *bits < ALARM_MAX ? *bits : ALARM_MAX - 1;
+
+	*bits -= part;
+	return fdserial_alarm_ticks(part);
+}
+
+/*
+**  fdserial_alarm_expired(alarm)
+**    Return true once the alarm has expired.
+*/
+
+uint8_t fdserial_alarm_expired(uint8_t alarm) {
+	uint8_t sreg = SREG;
+	uint8_t expired;
+
+	cli();
+	expired = _alarm_expired(alarm);
+	SREG = sreg;
+	return expired;
+}
+
+/*
+**  fdserial_alarm_cancel(alarm)
+**    Stop the alarm early, freeing it for reuse. Once no alarm is
+**    running, TIMER1_COMPA is turned off again at the next bit.
+*/
+
+void fdserial_alarm_cancel(uint8_t alarm) {
+	uint8_t sreg = SREG;
+
+	cli();
+	fd_uart1.alarms_set &= ~( 1<<alarm );
+	SREG = sreg;
+}
+
+/*
+**  fdserial_delay(uint32_t duration)
+**
+**  Delay for the specified number of ms.
+**
+**  Setup an alarm for the specified duration, then wait until it
+**  has expired; one after another if it is longer than an alarm
+**  can time.
+*/
+
+void fdserial_delay(uint32_t duration) {
+	uint32_t bits = fdserial_ms_to_ticks(duration);
+	uint8_t alarm;
+
+	do {
+		alarm = _alarm_part(&bits);
+		_wait_until(fdserial_alarm_expired(alarm));
+	} while (bits);
+}
+
+/*
+**  c = fdserial_recv_timeout(ticks)
+**    Receive a character, waiting at most ticks bit times for it,
+**    with one alarm after another if that is longer than an alarm
+**    can time. Return -1 if none came.
+*/
+
+int16_t fdserial_recv_timeout(uint32_t ticks) {
+	uint8_t alarm;
+
+	while (! fdserial_available()) {
+		if (! ticks) {
+			return -1;
+		}
+
+		alarm = _alarm_part(&ticks);
+		_wait_until(fdserial_available() || fdserial_alarm_expired(alarm));
+		fdserial_alarm_cancel(alarm);
+	}
+
+	return fdserial_recv();
+}
+
+/*
+**  n = fdserial_read_idle(buf, len, chars)
+**    Wait for a character, then receive into buf until the line has
+**    been silent for chars character times or len bytes have come.
+**    Silence is timed from when each byte is taken from the buffer,
+**    and a frame still arriving at the end of it counts as activity.
+**    Returns the number of bytes received.
+*/
+
+uint8_t fdserial_read_idle(fd_char_t *buf, uint8_t len, uint8_t chars) {
+	uint8_t n = 0;
+	uint8_t alarm;
+
+	_wait_until(fdserial_available());
+
+	while (1) {
+		n += fdserial_tryread(buf + n, len - n);
+		if (n == len) {
+			break;
+		}
+
+		// INT0 is enabled only between frames
+		alarm = fdserial_alarm_ticks((uint16_t) chars * FRAME_BITS);
+		_wait_until(fdserial_available()
+			|| (fdserial_alarm_expired(alarm) && (GIMSK & 1<<INT0)));
+		fdserial_alarm_cancel(alarm);
+
+		if (! fdserial_available()) {
+			break;
+		}
+	}
+
+	return n;
+}
+
+#ifndef FDSERIAL_USI_TX
+/*
+**  Set the TX line for this bit, or with FDSERIAL_ASM_TX, for the
+**  next one: fd-serial-tx.S drives it at the start of the next
+**  interrupt.
+*/
+
+static inline void _tx_level(uint8_t bit) {
+#ifdef FDSERIAL_ASM_TX
+	fdserial_tx_level = bit;
+#else
+	if (bit) {
+		PORTB |= S1_TX_PIN;
+	} else {
+		PORTB &= ~( S1_TX_PIN );
+	}
+#endif
+}
+#endif
+
+/*
+**  Send the next TX bit, and count a bit time for the alarms.
+**  Interrupt handler for timer1, TCCR1A, tx bits; with FDSERIAL_ASM_TX,
+**  called from fd-serial-tx.S for every state but 2.
+**
+**  tx_states[] gives the code for each tx_state, so every state is
+**  reached in the same few cycles; a switch this small compiles to a
+**  chain of compares. Each state sets the line before anything else.
+**
+**  Cycles from the compare match, with 6 for the interrupt response
+**  and vector rjmp, from a clang 14 -Os build with the default
+**  options; check them against avr-objdump -d fd-serial.o:
+**
+**                                TX edge   reti done
+**    0 idle                         -        83-102
+**    1 start bit                   47       101-120
+**    2 data bit                    55       101-126
+**    3 stop bit                    47        84-103
+**    4 end of stop bit            (54)       93-127
+**
+**  Every state is reached at cycle 45. A data bit's level is worked
+**  out before it is set, so its edge comes 8 cycles later than the
+**  others. State 4 only makes an edge when it goes straight on to
+**  the next start bit.
+*/
+
+#ifdef FDSERIAL_ASM_TX
+void fdserial_tx_slow(void)
+#else
+ISR(TIMER1_COMPA_vect)
+#endif
+{
+	static void * const tx_states[] = {
+		&&tx_idle,
+#ifdef FDSERIAL_USI_TX
+		// Sent by USI_OVF_vect
+		&&tx_idle, &&tx_idle, &&tx_idle, &&tx_idle,
+#else
+		&&tx_start,
+#ifdef FDSERIAL_ASM_TX
+		&&tx_idle, // Sent by fd-serial-tx.S
+#else
+		&&tx_data,
+#endif
+		&&tx_tail, &&tx_stop,
+#endif
+#ifdef FDSERIAL_ASM_TX
+		&&tx_stop_end,
+#endif
+	};
+	uint8_t ticks = 1;
+
+	_profile_start();
+
+#if defined(SERIAL_DITHER) && ! defined(FDSERIAL_USI_TX)
+	if (TX_STATE && _dither(&fd_uart1.tx_dither)) {
+		OCR1A = _tick_before(OCR1A);
+	}
+#endif
+
+	goto *tx_states[TX_STATE];
+
+#ifndef FDSERIAL_USI_TX
+
+tx_start: // 1: Send start bit
+	_tx_level(0);
+#ifdef TX_RING_BUFFER
+	{
+		fd_char_t c = fd_uart1.tx_buf[fd_uart1.tx_tail & TX_MASK];
+
+		fd_uart1.tx_tail ++;
+		SEND_BYTE = c;
+#if FRAME_TAIL_BITS > 1
+		fd_uart1.send_tail = _frame_tail(c);
+#endif
+	}
+#endif
+	TX_STATE = 2;
+	SEND_BITS = FRAME_DATA8;
+	goto tx_done;
+
+#ifndef FDSERIAL_ASM_TX
+tx_data: // 2: Send a bit
+	_tx_level(SEND_BYTE & 1);
+	SEND_BYTE >>= 1;
+
+	if (! --SEND_BITS) {
+		TX_STATE = 3;
+#if FRAME_TAIL_BITS > 1
+		SEND_BITS = FRAME_TAIL_BITS;
+#endif
+	}
+	goto tx_done;
+#endif
+
+tx_tail: // 3: Send stop bit
+#if FRAME_TAIL_BITS > 1
+	// Or 9th data bit, parity and stop bits from send_tail
+	_tx_level(fd_uart1.send_tail & 1);
+	fd_uart1.send_tail >>= 1;
+
+#ifdef FDSERIAL_ASM_TX
+	// The data bits went by in fd-serial-tx.S, uncounted
+	if (SEND_BITS == FRAME_TAIL_BITS) {
+		ticks += FRAME_DATA8;
+	}
+#endif
+
+	if (! --SEND_BITS) {
+		TX_STATE = 4;
+	}
+#else
+	_tx_level(1);
+	TX_STATE = 4;
+#ifdef FDSERIAL_ASM_TX
+	ticks += FRAME_DATA8;
+#endif
+#endif
+	goto tx_done;
+
+tx_stop: // 4: End of stop bit
+#ifdef TX_RING_BUFFER
+	if (fd_uart1.tx_head != fd_uart1.tx_tail) {
+		// Send the next byte without a gap
+		goto tx_start;
+	}
+#endif
+#ifdef FDSERIAL_ASM_TX
+	// The stop bit has only now reached the line
+	TX_STATE = 5;
+	goto tx_done;
+
+tx_stop_end: // 5: End of stop bit, nothing was queued
+#ifdef TX_RING_BUFFER
+	if (fd_uart1.tx_head != fd_uart1.tx_tail) {
+		goto tx_start;
+	}
+#endif
+#endif
+	// Return to idle mode
+	fd_uart1.send_ready = 1;
+	TX_STATE = 0;
+	_stop_tx();
+	_timer_idle();
+	goto tx_done;
+#endif
+
+tx_idle: // 0: Idle, or with FDSERIAL_USI_TX, sending: only alarms
+	// and the tick count
+	if (! fd_uart1.alarms_set) {
+		_stop_tx();
+		_timer_idle();
+#ifndef FDSERIAL_TICKS
+		goto tx_end;
+#endif
+	}
+
+#ifndef FDSERIAL_USI_TX
+tx_done:
+#endif
+	// Alarms count bit times whatever TX is doing
+	if (fd_uart1.alarms_set) {
+		_tick_alarms(ticks);
+	}
+#ifdef FDSERIAL_TICKS
+	fd_uart1.ticks += ticks;
+	{
+		// MS_CYCLES bit times make a whole number of ms: one
+		// per CPU cycle in a bit
+		uint16_t ms_ticks = fd_uart1.ms_ticks + ticks;
+
+		if (ms_ticks >= MS_CYCLES) {
+			ms_ticks -= MS_CYCLES;
+			fd_uart1.ms += fd_uart1.bit_cycles;
+		}
+		fd_uart1.ms_ticks = ms_ticks;
+	}
+#endif
+
+#ifndef FDSERIAL_TICKS
+tx_end:
+#endif
+	_profile_end();
+}
+
+#ifdef FDSERIAL_USI_TX
+/*
+**  USI counter overflow: the first part of a frame has gone out
+**  and DO is showing bit 7, or the last stop bit has ended.
+*/
+
+ISR(USI_OVF_vect)
+{
+	if (TX_STATE == 1) {
+		// Rest of the frame, starting with the bit on DO
+		USIDR = SEND_BYTE;
+		USISR = 1<<USIOIF | (16 - (FRAME_BITS - 7));
+		TX_STATE = 2;
+		return;
+	}
+
+	if (fd_uart1.tx_head != fd_uart1.tx_tail) {
+		// Send the next byte without a gap
+		_usi_load();
+		return;
+	}
+
+	// Stop shifting; DO holds the idle high level
+	USICR = 1<<USIWM0;
+	USISR = 1<<USIOIF;
+	TX_STATE = 0;
+	fd_uart1.send_ready = 1;
+	_timer_idle();
+}
+#endif
+
+/*
+**  With FDSERIAL_FRAMES, drop the frame arriving once it ends: a
+**  character of it has been lost.
+*/
+
+static inline void _frame_lost(void) {
+#ifdef FDSERIAL_FRAMES
+	fd_uart1.frame_bad = 1;
+#endif
+}
+
+#ifdef FDSERIAL_FRAMES
+/*
+**  The line has been silent for FDSERIAL_T35: queue the frame which
+**  arrived before it, or drop it by taking its bytes off the head
+**  of the buffer, where they are the newest.
+*/
+
+static inline void _frame_end(void) {
+	uint8_t bytes = fd_uart1.frame_bytes;
+	uint8_t head = fd_uart1.frame_head;
+
+	if (bytes) {
+		if (! fd_uart1.frame_bad && (uint8_t) (head - fd_uart1.frame_tail) == FDSERIAL_FRAMES) {
+			// Too many frames unread
+			fd_uart1.overflows ++;
+			fd_uart1.errors |= FDSERIAL_ERR_OVERFLOW;
+			fd_uart1.frame_bad = 1;
+		}
+
+		if (fd_uart1.frame_bad) {
+			fd_uart1.rx_head -= bytes;
+		} else {
+			fd_uart1.frame_len[head & FRAME_MASK] = bytes;
+			fd_uart1.frame_head = head + 1;
+		}
+	}
+
+	fd_uart1.frame_bytes = 0;
+	fd_uart1.frame_bad = 0;
+}
+#endif
+
+/*
+**  Store a received character, applying RX_OVERFLOW if the caller
+**  has fallen behind. Called from TIMER1_COMPB_vect.
+*/
+
+static inline void _rx_store(fd_char_t c) {
+#ifdef RING_BUFFER
+	uint8_t head = fd_uart1.rx_head;
+
+#if RX_OVERFLOW == RX_STOP
+	// Stopped until the caller sees the overflow
+	if (fd_uart1.errors & FDSERIAL_ERR_OVERFLOW) {
+		fd_uart1.overflows ++;
+		_frame_lost();
+		return;
+	}
+#endif
+
+	if ((uint8_t) (head - fd_uart1.rx_tail) == RING_BUFFER) {
+		fd_uart1.overflows ++;
+		fd_uart1.errors |= FDSERIAL_ERR_OVERFLOW;
+#if RX_OVERFLOW == RX_DROP_OLDEST
+#ifdef FDSERIAL_DELIMITER
+		if (fd_uart1.rx_buf[fd_uart1.rx_tail & RX_MASK] == FDSERIAL_DELIMITER) {
+			fd_uart1.lines --;
+		}
+#endif
+		fd_uart1.rx_tail ++;
+#else
+		_frame_lost();
+		return;
+#endif
+	}
+
+	// Put the latest char in the buffer
+	fd_uart1.rx_buf[head & RX_MASK] = c;
+	fd_uart1.rx_head = head + 1;
+#ifdef FDSERIAL_FRAMES
+	fd_uart1.frame_bytes ++;
+#endif
+#ifdef FDSERIAL_DELIMITER
+	if (c == FDSERIAL_DELIMITER) {
+		fd_uart1.lines ++;
+	}
+#endif
+#else
+	if (fd_uart1.available) {
+		// Previous char was never read; it is overwritten
+		fd_uart1.overflows ++;
+		fd_uart1.errors |= FDSERIAL_ERR_OVERFLOW;
+	}
+
+	fd_uart1.recv_byte = c;
+	fd_uart1.available = 1;
+#endif
+}
+
+/*
+**  Assemble the received character from recv_shift and recv_tail,
+**  check its parity and store it.
+*/
+
+static inline void _rx_char(void) {
+	fd_char_t c = RECV_SHIFT >> (8 - FRAME_DATA8);
+#if FRAME_EXTRA_BITS
+	uint8_t tail = fd_uart1.recv_tail >> (8 - FRAME_EXTRA_BITS);
+
+#if SERIAL_DATA_BITS > 8
+	c |= (fd_char_t) (tail & 1) << 8;
+	tail >>= 1;
+#endif
+#if FRAME_PARITY_BITS
+	if (tail != _parity_bit(c)) {
+		fd_uart1.parity_errors ++;
+		fd_uart1.errors |= FDSERIAL_ERR_PARITY;
+		_frame_lost();
+		return;
+	}
+#endif
+#endif
+
+#ifdef FDSERIAL_ADDRESS
+	if ((c & 0x100) && fd_uart1.addr_filter) {
+		// Address byte: is the sender talking to us?
+		fd_uart1.selected = (uint8_t) c == fd_uart1.address;
+	}
+
+	if (! fd_uart1.selected) {
+		return;
+	}
+#endif
+
+	_rx_store(c);
+}
+
+/*
+** Interrupt handler for timer1, TCCR1B, rx bits
+**
+** Dispatched through rx_states[] like the TX handler, so the time
+** to reach each state does not depend on the state number.
+**
+** Counted as for the TX handler, the pin is read at cycle 31 and
+** each state is reached at 47, so the sampling point does not move
+** with the state. Cycles to the end of the reti:
+**
+**   0, 1 start bit                82
+**   2 data bit                91-101
+**   3 stop bit                92-130
+**   4 break                   85-105
+**   5 end of break             79-89
+*/
+
+ISR(TIMER1_COMPB_vect)
+{
+	static void * const rx_states[] = {
+		&&rx_start, &&rx_start, &&rx_data, &&rx_stop,
+		&&rx_break, &&rx_break_end,
+#if FRAME_EXTRA_BITS
+		&&rx_extra,
+#elif defined(FDSERIAL_FRAMES)
+		&&rx_done, // No 9th data or parity bit
+#endif
+#ifdef FDSERIAL_FRAMES
+		&&rx_gap,
+#endif
+	};
+
+	// Read the bit as early as possible, to try to hit the
+	// center mark
+	uint8_t read_bit = PINB & S1_RX_PIN;
+
+	_profile_start();
+
+#ifdef SERIAL_DITHER
+	if (_dither(&fd_uart1.rx_dither)) {
+		OCR1B = _tick_before(OCR1B);
+	}
+#endif
+
+	goto *rx_states[RX_STATE];
+
+rx_start: // 0, 1: Midpoint of start bit. Go on to first data bit.
+	RX_STATE = 2;
+	fd_uart1.recv_bits = FRAME_DATA8;
+	goto rx_done;
+
+rx_data: // 2: Reading a data bit
+	RECV_SHIFT >>= 1;
+	if (read_bit) {
+		RECV_SHIFT |= 0x80;
+	}
+
+	if (! --fd_uart1.recv_bits) {
+#if FRAME_EXTRA_BITS
+		RX_STATE = 6;
+		fd_uart1.recv_bits = FRAME_EXTRA_BITS;
+#else
+		RX_STATE = 3;
+#endif
+	}
+	goto rx_done;
+
+#if FRAME_EXTRA_BITS
+rx_extra: // 6: Reading the 9th data bit or parity bit
+	fd_uart1.recv_tail >>= 1;
+	if (read_bit) {
+		fd_uart1.recv_tail |= 0x80;
+	}
+
+	if (! --fd_uart1.recv_bits) {
+		RX_STATE = 3;
+	}
+	goto rx_done;
+#endif
+
+rx_stop: // 3: Stop bit
+	if (read_bit) {
+		_rx_char();
+	} else if (! (RECV_SHIFT >> (8 - FRAME_DATA8))
+#if FRAME_EXTRA_BITS
+		&& ! (fd_uart1.recv_tail >> (8 - FRAME_EXTRA_BITS))
+#endif
+		) {
+		// All low so far: may be a break. Keep
+		// sampling, counting the low bit times left.
+		fd_uart1.recv_bits = SERIAL_BREAK_BITS - FRAME_LOW_BITS;
+		RX_STATE = 4;
+		goto rx_done;
+	} else {
+		// Framing error: drop the byte. The next falling
+		// edge is taken as a start bit, so one bad frame
+		// costs one byte.
+		fd_uart1.frame_errors ++;
+		fd_uart1.errors |= FDSERIAL_ERR_FRAMING;
+		_frame_lost();
+	}
+	goto rx_idle;
+
+rx_break: // 4: Possible break, line low
+	if (read_bit) {
+		// Too short: a zero byte with a low stop bit
+		fd_uart1.frame_errors ++;
+		fd_uart1.errors |= FDSERIAL_ERR_FRAMING;
+		_frame_lost();
+		goto rx_idle;
+	} else if (! --fd_uart1.recv_bits) {
+		fd_uart1.breaks ++;
+		fd_uart1.errors |= FDSERIAL_ERR_BREAK;
+		_frame_lost();
+#ifdef FDSERIAL_ON_BREAK
+		FDSERIAL_ON_BREAK;
+#endif
+		RX_STATE = 5;
+	}
+	goto rx_done;
+
+rx_break_end: // 5: Break, wait for the line to go high
+	if (! read_bit) {
+		goto rx_done;
+	}
+
+rx_idle: // End of frame: wait for the next start bit
+#ifdef FDSERIAL_FRAMES
+	// and time the silence until it comes
+	RX_STATE = RX_GAP;
+	fd_uart1.gap = 0;
+	_enable_int0();
+	goto rx_done;
+
+rx_gap: // 7: Between characters
+	if (++fd_uart1.gap != FDSERIAL_T35) {
+		goto rx_done;
+	}
+	_frame_end();
+	RX_STATE = 0;
+	_stop_rx();
+#else
+	RX_STATE = 0;
+	_stop_rx();
+	_enable_int0();
+#endif
+	_timer_idle();
+
+rx_done:
+	_profile_end();
+}
+
+/*
+** This is called on the falling edge of INT0 (pin 7).
+** It is the beginning of a start bit.
+*/
+
+ISR(INT0_vect) {
+	uint8_t tcnt1;
+	uint8_t halfbit = fd_uart1.halfbit;
+
+	_wake_timer();
+	tcnt1 = TCNT1;
+
+#ifdef FDSERIAL_AUTOBAUD
+	if (fd_uart1.autobaud) {
+		_autobaud_edge(tcnt1);
+		return;
+	}
+#endif
+
+#ifdef FDSERIAL_POWER_DOWN
+	// Level sensed: this edge woke the MCU from power-down, and the
+	// start bit began while the clock was starting. Time the sample
+	// from when it began.
+	if (! (MCUCR & ( 1<<ISC01 | 1<<ISC00 ))) {
+		uint8_t wake = fd_uart1.wake_ticks;
+
+		MCUCR |= 1<<ISC01;
+		if (tcnt1 >= wake) {
+			tcnt1 -= wake;
+		} else {
+			tcnt1 += fd_uart1.top + 1 - wake;
+		}
+	}
+#endif
+
+#ifdef FDSERIAL_FRAMES
+	// A character after a silence of FDSERIAL_T15 but not T35
+	// spoils the frame
+	if (RX_STATE == RX_GAP && fd_uart1.gap >= FDSERIAL_T15) {
+		fd_uart1.errors |= FDSERIAL_ERR_GAP;
+		fd_uart1.frame_bad = 1;
+	}
+	RX_STATE = 0;
+#endif
+
+	// Set sample time, half a bit after now.
+	if (tcnt1 >= halfbit) {
+		OCR1B = tcnt1 - halfbit;
+	} else {
+		OCR1B = tcnt1 + halfbit;
+	}
+
+#ifdef SERIAL_DITHER
+	// Start each frame with the accumulator half full
+	fd_uart1.rx_dither = 0x80;
+#endif
 
 	_disable_int0();
 	_start_rx();
@@ -6,35 +6,341 @@
 #ifndef _FD_SERIAL_H
 #define _FD_SERIAL_H
 
+#ifndef __ASSEMBLER__
 #include <stdint.h>
+#endif
+
+// Size of rx buffer, a power of two up to 128. This many characters
+// can be received in the background and not yet read by the caller.
+#define RING_BUFFER 32
+
+// Size of tx buffer, a power of two up to 128. fdserial_send()
+// queues the byte and returns at once; the TX interrupt sends
+// queued bytes back to back.
+#define TX_RING_BUFFER 16
+
+// What to do with a received character when the rx buffer is full:
+//   RX_DROP_OLDEST  discard the oldest buffered character
+//   RX_DROP_NEWEST  discard the character just received
+//   RX_STOP         discard it and every later one until the caller
+//                   clears FDSERIAL_ERR_OVERFLOW with fdserial_errors(),
+//                   so the stream has a single clean break
+#define RX_DROP_OLDEST 0
+#define RX_DROP_NEWEST 1
+#define RX_STOP        2
+
+// Define FDSERIAL_FRAMES as the number of received frames to queue, a
+// power of two, to split the input into frames at silences as Modbus
+// RTU does, for fdserial_get_frame(). A frame ends after FDSERIAL_T35
+// bit times with no start bit, 3.5 characters by default. One which
+// falls silent for FDSERIAL_T15, 1.5 characters, and then goes on is
+// dropped, as is one with any character lost. Both are counted from
+// the middle of the last stop bit. Read only with
+// fdserial_get_frame(). Not with RX_DROP_OLDEST, which would take
+// bytes from frames already queued.
+// #define FDSERIAL_FRAMES 4
+
+// Define FDSERIAL_DELIMITER as the character ending a line, to have
+// the RX interrupt count whole lines in the rx buffer as it stores
+// them. fdserial_lines() returns the count and fdserial_readline()
+// waits, sleeping with FDSERIAL_SLEEP, until there is a line to take
+// in one call. Not with FDSERIAL_FRAMES.
+// #define FDSERIAL_DELIMITER '\n'
+
+#ifndef RX_OVERFLOW
+#ifdef FDSERIAL_FRAMES
+#define RX_OVERFLOW RX_DROP_NEWEST
+#else
+#define RX_OVERFLOW RX_DROP_OLDEST
+#endif
+#endif
+
+// Sticky error bits returned by fdserial_errors()
+#define FDSERIAL_ERR_OVERFLOW 0x01   // A received character was lost
+#define FDSERIAL_ERR_FRAMING  0x02   // A stop bit was low
+#define FDSERIAL_ERR_BREAK    0x04   // A break was received
+#define FDSERIAL_ERR_PARITY   0x08   // A character had bad parity
+#define FDSERIAL_ERR_GAP      0x10   // A frame had a gap of FDSERIAL_T15
+
+// A frame of all zeroes whose stop bit is low, with the line then
+// staying low until SERIAL_BREAK_BITS bit times from the start bit,
+// is a break rather than a framing error. Define FDSERIAL_ON_BREAK
+// as a function or statement to run in the RX interrupt when one is
+// seen, e.g. to mark a packet boundary.
+#ifndef SERIAL_BREAK_BITS
+#define SERIAL_BREAK_BITS 20
+#endif
+
+// Number of alarms which can run at once, 1 to 8. Alarms count bit
+// times on TIMER1_COMPA alongside whatever TX is doing.
+#ifndef FDSERIAL_ALARMS
+#define FDSERIAL_ALARMS 4
+#endif
+
+// Frame format, 8N1 by default. SERIAL_DATA_BITS is 5 to 9; with 9,
+// characters are fd_char_t (uint16_t) and bit 8 is the ninth data
+// bit, as used for multidrop addressing. SERIAL_STOP_BITS is 1 or 2;
+// the receiver checks only the first.
+#define SERIAL_PARITY_NONE 0
+#define SERIAL_PARITY_EVEN 1
+#define SERIAL_PARITY_ODD  2
+
+#ifndef SERIAL_DATA_BITS
+#define SERIAL_DATA_BITS 8
+#endif
+
+#ifndef SERIAL_PARITY
+#define SERIAL_PARITY SERIAL_PARITY_NONE
+#endif
+
+#ifndef SERIAL_STOP_BITS
+#define SERIAL_STOP_BITS 1
+#endif
+
+// Define FDSERIAL_ADDRESS with 9 data bits for multidrop address
+// filtering: a character with bit 8 set is an address byte, and
+// after fdserial_set_address() the receiver drops everything except
+// an address byte matching this node and the data that follows it.
+// #define FDSERIAL_ADDRESS
+
+// Derived from the frame format
+
+// With #if, not a comparison: fd-serial-tx.S expands these, and the
+// assembler takes a true comparison as -1
+#if SERIAL_PARITY == SERIAL_PARITY_NONE
+#define FRAME_PARITY_BITS 0
+#else
+#define FRAME_PARITY_BITS 1
+#endif
+
+// Data bits shifted through send_byte and recv_shift
+#if SERIAL_DATA_BITS > 8
+#define FRAME_DATA8 8
+#else
+#define FRAME_DATA8 SERIAL_DATA_BITS
+#endif
+
+// Bits between those and the stop bit: the 9th data bit and parity
+#define FRAME_EXTRA_BITS (SERIAL_DATA_BITS - FRAME_DATA8 + FRAME_PARITY_BITS)
+
+// Bits sent from send_tail after the data bits, stop bits included.
+// For 8N1 this is just the stop bit, which needs no send_tail.
+#define FRAME_TAIL_BITS (FRAME_EXTRA_BITS + SERIAL_STOP_BITS)
+
+// Start bit, data bits, parity and stop bit all low
+#define FRAME_LOW_BITS (2 + SERIAL_DATA_BITS + FRAME_PARITY_BITS)
+
+// Start bit to last stop bit
+#define FRAME_BITS (FRAME_LOW_BITS + SERIAL_STOP_BITS - 1)
+
+#ifdef FDSERIAL_FRAMES
+// Silences in bit times from the middle of the stop bit: 1.5 and 3.5
+// characters with the half stop bit added, rounded up
+#ifndef FDSERIAL_T15
+#define FDSERIAL_T15 ((3 * FRAME_BITS + 2) / 2)
+#endif
+#ifndef FDSERIAL_T35
+#define FDSERIAL_T35 ((7 * FRAME_BITS + 2) / 2)
+#endif
+#endif
 
-// Size of rx buffer. Up to one less characters can be
-// received in the background and not yet read by the caller.
-#define RING_BUFFER 20
+#ifndef __ASSEMBLER__
+#if SERIAL_DATA_BITS > 8
+typedef uint16_t fd_char_t;
+#else
+typedef unsigned char fd_char_t;
+#endif
+#endif
 
 #ifndef SERIAL_RATE
-// Support for different bitrates is not presently implemented
+// Bits per second. 1200 to 57600 at 8 MHz; 115200 needs CPU_FREQ
+// of 16 MHz. Timer settings are worked out at compile time.
+// Full duplex with frames arriving back to back needs about 200
+// CPU cycles per bit, so 38400 at 8 MHz. Above that, send and
+// receive in turn, or have the peer leave a couple of idle bit
+// times between frames.
 #define SERIAL_RATE 9600
 #endif
 
+// Define SERIAL_DITHER when the bit time is not a whole number of
+// timer ticks: bits alternate between two lengths a tick apart so
+// the mean bit time matches SERIAL_RATE. Worthwhile at high rates,
+// where rounding to whole ticks gives a large error.
+// #define SERIAL_DITHER
+
+// Define FDSERIAL_AUTOBAUD for fdserial_autobaud(), which times a
+// 'U' sent by the host and switches to the nearest standard rate.
+// AUTOBAUD_MIN_RATE is the slowest rate it can time. Timer1 stops
+// counting bit times meanwhile, so not with FDSERIAL_TICKS.
+// #define FDSERIAL_AUTOBAUD
+
+#ifndef AUTOBAUD_MIN_RATE
+#define AUTOBAUD_MIN_RATE 1200
+#endif
+
+// Define FDSERIAL_USI_TX to send with the USI instead of a Timer1
+// interrupt per bit. The USI in three-wire mode shifts each frame
+// out of DO, clocked by Timer0 compare match, with two USI overflow
+// interrupts per frame. TX moves to PB1 (DO), and Timer0 is taken,
+// so libserial0 cannot be used alongside. Needs TX_RING_BUFFER.
+// The Makefile builds this variant as libfdserial-usi.a.
+// #define FDSERIAL_USI_TX
+
+// Define FDSERIAL_ASM_TX to take TIMER1_COMPA_vect from fd-serial-tx.S,
+// which sends data bits saving only one register. The TX state, shift
+// register and bit count then live in GPIOR0-2, and the other states
+// are left to fdserial_tx_slow() in C. So that every edge comes at
+// the same point in the handler, each bit's level is worked out one
+// interrupt ahead, in fdserial_tx_level, and sending starts a bit
+// time later. Its start and stop bits hold RX off for longer than
+// the C handler, so full duplex runs at up to 19200 at 8 MHz, 14400
+// with FDSERIAL_TICKS; see fd-serial-tx.S. Not with FDSERIAL_USI_TX
+// or SERIAL_DITHER. The Makefile builds this variant as
+// libfdserial-asm.a.
+// #define FDSERIAL_ASM_TX
+
+// Define FDSERIAL_SLEEP for the calls which wait (fdserial_send() on
+// a full buffer, fdserial_recv(), fdserial_read(), fdserial_write(),
+// fdserial_delay() and the rest) to sleep in idle mode between
+// interrupts instead of spinning. The sleep mode is set to idle on
+// each wait.
+// #define FDSERIAL_SLEEP
+
+// Define FDSERIAL_STOP_TIMER to stop Timer1 whenever TX is idle, no
+// alarm is set and RX is waiting for a start bit. INT0 starts it
+// again, as does sending or setting an alarm. A byte takes a few
+// more cycles to start, and Timer1 can't be shared while stopped.
+// #define FDSERIAL_STOP_TIMER
+
+// Define FDSERIAL_POWER_DOWN for fdserial_powerdown(), which sleeps
+// in power-down mode while the line is idle, until a start bit
+// arrives. FDSERIAL_WAKEUP_CYCLES is the CPU cycles from the falling
+// edge to the INT0 handler, mostly the clock start-up time set by the
+// SUT fuses: 6 for the internal oscillator, plus 4 more to take the
+// interrupt from sleep. Much slower clocks, like a crystal's 16K
+// cycles, can't catch the first byte.
+// #define FDSERIAL_POWER_DOWN
+// #define FDSERIAL_WAKEUP_CYCLES 10
+
+// Define FDSERIAL_TICKS for fdserial_ticks(), a 32-bit count of bit
+// times since fdserial_init(), and fdserial_millis() and
+// fdserial_micros() from it. TIMER1_COMPA then runs on every bit even
+// when idle. Not with FDSERIAL_STOP_TIMER, and the count stands still
+// in fdserial_powerdown().
+// #define FDSERIAL_TICKS
+
+// Define FDSERIAL_GPIOR to keep rx_state, recv_shift and send_byte
+// in GPIOR0-2 rather than SRAM. They are read or written on every
+// bit, and the I/O registers take one cycle for in and out instead
+// of two for lds and sts, and single bits can be tested with sbis.
+// There are only three, so tx_state stays in SRAM. Not with
+// FDSERIAL_ASM_TX, which has its own use for them.
+// #define FDSERIAL_GPIOR
+
+// Define FDSERIAL_PROFILE_PIN as a PORTB bit mask, e.g. (1<<PORTB4),
+// to drive that pin high while each Timer1 handler runs, so the time
+// taken by each state can be measured with a logic analyser or with
+// "uartpeer -p 4" under simavr.
+// #define FDSERIAL_PROFILE_PIN (1<<PORTB4)
+
+#ifdef FDSERIAL_ASM_TX
+#define TX_STATE_REG  GPIOR0
+#define SEND_BYTE_REG GPIOR1
+#define SEND_BITS_REG GPIOR2
+#endif
+
 #define S1_RX_PIN   (1<<PINB2)
-#define S1_TX_PIN   (1<<PORTB3)
+#ifdef FDSERIAL_USI_TX
+#define S1_TX_BIT   PORTB1
+#else
+#define S1_TX_BIT   PORTB3
+#endif
+#define S1_TX_PIN   (1<<S1_TX_BIT)
+
+#ifndef __ASSEMBLER__
 
 struct fd_uart {
+#ifndef FDSERIAL_ASM_TX
 	volatile uint8_t tx_state;
+#endif
+#ifndef FDSERIAL_GPIOR
 	volatile uint8_t rx_state;
+#endif
+#if ! defined(FDSERIAL_ASM_TX) && ! defined(FDSERIAL_GPIOR)
 	volatile unsigned char send_byte;  // byte presently being sent (shifted)
-	volatile unsigned char recv_byte;  // buffered received byte
+#endif
+	volatile fd_char_t recv_byte;      // buffered received byte
+#ifndef FDSERIAL_GPIOR
 	volatile unsigned char recv_shift; // rx data shifted into this byte
+#endif
+	volatile uint8_t send_tail;        // 9th bit, parity, stop bits to send
+	volatile uint8_t recv_tail;        // 9th bit and parity shifted in here
+#ifndef FDSERIAL_ASM_TX
 	volatile uint8_t send_bits;        // Number of bits remaining to send
+#endif
 	volatile uint8_t recv_bits;        // Number of bits remaining to receive
 	volatile uint8_t available;        // 1 = rx data available
-	volatile uint8_t send_ready;       // 1 = can send a byte
-	volatile uint16_t delay;           // Number of bit times to delay
+	volatile uint8_t send_ready;       // 1 = transmitter idle
+	volatile uint16_t alarm_ticks;     // Bit times counted while alarms run
+#ifdef FDSERIAL_TICKS
+	volatile uint32_t ticks;           // Bit times since fdserial_init()
+	volatile uint32_t ms;              // Whole ms, when ms_ticks was 0
+	volatile uint16_t ms_ticks;        // Bit times since, up to MS_CYCLES
+	volatile uint16_t ms_cycles;       // CPU cycles past ms at ms_ticks 0
+	volatile uint16_t bit_cycles;      // CPU cycles per bit
+#endif
+	volatile uint16_t alarm_stop;      // alarm_ticks when the last one ends
+	volatile uint16_t alarm_end[FDSERIAL_ALARMS];
+	volatile uint8_t alarms_set;       // One bit per alarm, 0 = none running
+	volatile uint8_t errors;           // FDSERIAL_ERR_ bits since last read
+	volatile uint16_t overflows;       // Received chars lost, ever
+	volatile uint16_t frame_errors;    // Frames dropped for a low stop bit
+	volatile uint16_t breaks;          // Breaks received
+	volatile uint16_t parity_errors;   // Chars dropped for bad parity
+#ifdef FDSERIAL_ADDRESS
+	volatile uint8_t address;          // This node's address
+	volatile uint8_t addr_filter;      // 1 = drop frames for other nodes
+	volatile uint8_t selected;         // 1 = last address byte was ours
+#endif
+	volatile uint8_t prescaler;        // Timer1 clock select bits
+	volatile uint8_t top;              // Timer ticks per bit, less one
+	volatile uint8_t halfbit;          // Timer ticks per half bit
+#ifdef FDSERIAL_POWER_DOWN
+	volatile uint8_t wake_ticks;       // Timer ticks taken to wake up
+#endif
+#ifdef FDSERIAL_AUTOBAUD
+	volatile uint8_t autobaud;         // Autobaud state, 0 = off
+	volatile uint8_t ab_last;          // TCNT1 at the last edge
+	volatile uint8_t ab_min;           // Shortest and longest pulse
+	volatile uint8_t ab_max;
+	volatile uint16_t ab_span;         // Total ticks of pulses timed
+	volatile uint32_t rate;            // Rate to go back to if none fits
+#endif
+#ifdef SERIAL_DITHER
+	volatile uint8_t dither_step;      // Excess tick fraction per bit
+	volatile uint8_t tx_dither;        // Tick fraction accumulators
+	volatile uint8_t rx_dither;
+#endif
 #ifdef RING_BUFFER
-	volatile unsigned char rx_buf[RING_BUFFER];
-	volatile uint8_t rx_head;          // Index of next char to append
-	volatile uint8_t rx_tail;          // Index of next char to remove
+	volatile fd_char_t rx_buf[RING_BUFFER];
+	volatile uint8_t rx_head;          // Count of chars appended
+	volatile uint8_t rx_tail;          // Count of chars removed
+#endif
+#ifdef FDSERIAL_FRAMES
+	volatile uint8_t frame_len[FDSERIAL_FRAMES];
+	volatile uint8_t frame_head;       // Count of frames ended
+	volatile uint8_t frame_tail;       // Count of frames removed
+	volatile uint8_t frame_bytes;      // Chars stored in the frame arriving
+	volatile uint8_t frame_bad;        // 1 = drop the frame arriving
+	volatile uint8_t gap;              // Bit times since the last stop bit
+#endif
+#ifdef FDSERIAL_DELIMITER
+	volatile uint8_t lines;            // Delimiters in rx_buf
+#endif
+#ifdef TX_RING_BUFFER
+	volatile fd_char_t tx_buf[TX_RING_BUFFER];
+	volatile uint8_t tx_head;          // Count of chars appended
+	volatile uint8_t tx_tail;          // Count of chars sent
 #endif
 };
 
@@ -46,20 +352,185 @@ void fdserial_init(void);
 
 uint8_t fdserial_available(void);
 
-// Return true when the tx sender is idle
+// Return true when fdserial_send() can take a byte without waiting
 
 uint8_t fdserial_sendok(void);
 
-void fdserial_send(unsigned char send_arg);
+void fdserial_send(fd_char_t send_arg);
 
-unsigned char fdserial_recv(void);
+fd_char_t fdserial_recv(void);
 
-// Set an alarm for a specified number of ms hence
+// Queue up to len bytes for sending without waiting.
+// Return the number of bytes queued.
 
-void fdserial_alarm(uint32_t duration);
+uint8_t fdserial_trywrite(const fd_char_t *buf, uint8_t len);
 
-// Wait for a specified number of ms
+// Send len bytes, waiting for buffer space as needed
+
+uint8_t fdserial_write(const fd_char_t *buf, uint8_t len);
+
+// Copy up to len received bytes into buf without waiting.
+// Return the number of bytes copied.
+
+uint8_t fdserial_tryread(fd_char_t *buf, uint8_t len);
+
+// Receive len bytes into buf, waiting as needed
+
+uint8_t fdserial_read(fd_char_t *buf, uint8_t len);
+
+#ifdef FDSERIAL_FRAMES
+// Return the number of whole frames received and not yet read
+
+uint8_t fdserial_frames(void);
+
+// Wait for a whole frame and copy up to len bytes of it into buf.
+// Return its length, which is more than len if it was cut short.
+
+uint8_t fdserial_get_frame(fd_char_t *buf, uint8_t len);
+#endif
+
+#ifdef FDSERIAL_DELIMITER
+// Return the number of whole lines received and not yet read
+
+uint8_t fdserial_lines(void);
+
+// Wait for a whole line, or a full buffer, and copy up to len bytes
+// of it into buf, the delimiter included. Return the number copied.
+
+uint8_t fdserial_readline(fd_char_t *buf, uint8_t len);
+#endif
+
+// Return the FDSERIAL_ERR_ bits set since the last call, and clear them
+
+uint8_t fdserial_errors(void);
+
+// Return the number of received characters lost to a full buffer
+
+uint16_t fdserial_overflows(void);
+
+// Return the number of frames dropped for a low stop bit
+
+uint16_t fdserial_frame_errors(void);
+
+// Return the number of breaks received
+
+uint16_t fdserial_breaks(void);
+
+// Return the number of characters dropped for bad parity
+
+uint16_t fdserial_parity_errors(void);
+
+#ifdef FDSERIAL_ADDRESS
+// Receive only address bytes equal to addr, and data following them
+
+void fdserial_set_address(uint8_t addr);
+
+// Receive every character again
+
+void fdserial_clear_address(void);
+#endif
+
+// Change the bit rate once the line is idle. Return false if the
+// rate is not possible at CPU_FREQ.
+
+uint8_t fdserial_set_rate(uint32_t rate);
+
+#ifdef FDSERIAL_POWER_DOWN
+// Sleep until the next interrupt, in power-down mode if the line
+// is idle, so a start bit wakes the MCU
+
+void fdserial_powerdown(void);
+#endif
+
+#ifdef FDSERIAL_AUTOBAUD
+// Start timing a 'U' sync character in the background, once any
+// alarms running have expired. Alarms and fdserial_delay() must
+// not be used again until fdserial_autobaud_rate() returns a rate.
+
+void fdserial_autobaud_start(void);
+
+// Return 0 until the sync character has been timed, then lock
+// onto the nearest standard rate and return it. If that rate is
+// too fast for CPU_FREQ, go back to the rate in use before and
+// return that.
+
+uint32_t fdserial_autobaud_rate(void);
+
+// Wait for a sync character and return the rate locked onto
+
+uint32_t fdserial_autobaud(void);
+#endif
+
+// Set an alarm for a specified number of ms hence, at most 32766 bit
+// times (3.4 s at 9600, 0.56 s at 57600; longer ones are cut short),
+// and return its number. Waits if all FDSERIAL_ALARMS are running.
+// The number stays valid until the alarm expires and is reused by a
+// later call. Alarms end up to two bit times late: one from rounding
+// ms up to bit times and one for the bit time already started. With
+// FDSERIAL_ASM_TX, up to FRAME_DATA8 more while a byte is sent.
+
+uint8_t fdserial_alarm(uint32_t duration);
+
+// The same in bit times, ending up to one bit time late
+
+uint8_t fdserial_alarm_ticks(uint32_t bits);
+
+// Return true once the alarm has expired
+
+uint8_t fdserial_alarm_expired(uint8_t alarm);
+
+// Stop an alarm before it expires
+
+void fdserial_alarm_cancel(uint8_t alarm);
+
+// Wait for a specified number of ms, however many bit times that
+// is. Bytes can be sent meanwhile from interrupt handlers.
 
 void fdserial_delay(uint32_t duration);
 
+// Receive a character, or return -1 if none comes within ticks bit
+// times (see fdserial_ms_to_ticks()), any number of them
+
+int16_t fdserial_recv_timeout(uint32_t ticks);
+
+// Wait for a character, then receive up to len into buf until the
+// line has been silent for chars character times. Return the count.
+
+uint8_t fdserial_read_idle(fd_char_t *buf, uint8_t len, uint8_t chars);
+
+// Convert between ms or us and bit times at the present rate,
+// rounding down, or up for ms to bit times. With SERIAL_DITHER the
+// bit time is taken as the whole number of timer ticks, a little
+// over the mean.
+
+uint32_t fdserial_ms_to_ticks(uint32_t ms);
+uint32_t fdserial_ticks_to_ms(uint32_t ticks);
+uint32_t fdserial_ticks_to_us(uint32_t ticks);
+
+#ifdef FDSERIAL_TICKS
+// Bit times since fdserial_init(), wrapping after 2^32. With
+// FDSERIAL_ASM_TX the data bits of a byte being sent are added once
+// they are done.
+
+uint32_t fdserial_ticks(void);
+
+// Time since fdserial_init() in ms or us, carried on across rate
+// changes. The ms count wraps after 2^32 ms, about 50 days, and the
+// us count after 2^32 us, about 71 minutes, whatever fdserial_ticks()
+// does.
+
+uint32_t fdserial_millis(void);
+uint32_t fdserial_micros(void);
+#endif
+
+#ifdef FDSERIAL_ASM_TX
+// Level for TX at the next TIMER1_COMPA, in bit 0
+extern volatile uint8_t fdserial_tx_level;
+
+// Every TX state but data bits, called from fd-serial-tx.S
+void fdserial_tx_slow(void);
+#endif
+
+#endif /* __ASSEMBLER__ */
+
 #endif
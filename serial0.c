@@ -6,12 +6,15 @@
 **     This code uses Timer/Counter 0
 **     RX connected to PB2, pin 7
 **     TX connected to PB3, pin 2
-**     Speed 9600 bps, half duplex
+**     Speed SERIAL_RATE bps (default 9600), half duplex
 */
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <stdint.h>
+#ifdef SERIAL0_SLEEP
+#include <avr/sleep.h>
+#endif
 
 #include "serial0.h"
 
@@ -19,21 +22,79 @@
 #define CPU_FREQ 8000000
 #endif
 
-#if SERIAL_RATE == 9600
-// Prescaler CK/8
+// Largest acceptable bit rate error, in tenths of a percent
+#ifndef SERIAL_MAX_ERROR
+#define SERIAL_MAX_ERROR 20
+#endif
+
+// Fewest CPU cycles per bit which leave time for the interrupt
+#ifndef SERIAL_MIN_CYCLES
+#define SERIAL_MIN_CYCLES 128
+#endif
+
+#if CPU_FREQ / SERIAL_RATE < SERIAL_MIN_CYCLES
+#error "SERIAL_RATE is too fast for CPU_FREQ"
+#endif
+
+// CPU cycles per bit, rounded
+#define SERIAL_CYCLES ((CPU_FREQ + SERIAL_RATE / 2) / SERIAL_RATE)
+
+// Timer0 counts at most 256 ticks per bit. Use the smallest
+// prescaler which fits, for the finest bit timing.
+#if SERIAL_CYCLES <= 256
+#define PRESCALER ( 1<<CS00 )
+#define PRESCALER_DIVISOR 1
+#elif SERIAL_CYCLES <= 2048
 #define PRESCALER ( 1<<CS01 )
 #define PRESCALER_DIVISOR 8
-// 8000000 / PRESCALER / 9600 = 104.1666
-#define SERIAL_TOP 103
-#define SERIAL_HALFBIT 52
+#elif SERIAL_CYCLES <= 16384
+#define PRESCALER ( 1<<CS01 | 1<<CS00 )
+#define PRESCALER_DIVISOR 64
 #else
-#error "Serial rates other than 9600 are not presently supported"
+#error "SERIAL_RATE is too slow for CPU_FREQ"
+#endif
+
+// e.g. 8000000 / PRESCALER / 9600 = 104.1666
+#define SERIAL_TICKS ((CPU_FREQ / PRESCALER_DIVISOR + SERIAL_RATE / 2) / SERIAL_RATE)
+#define SERIAL_TOP (SERIAL_TICKS - 1)
+#define SERIAL_HALFBIT (SERIAL_TICKS / 2)
+
+// Bit rate actually achieved, and its error in tenths of a percent
+#define SERIAL_ACTUAL (CPU_FREQ / PRESCALER_DIVISOR / SERIAL_TICKS)
+#define SERIAL_ERROR ((SERIAL_ACTUAL > SERIAL_RATE ? \
+	SERIAL_ACTUAL - SERIAL_RATE : SERIAL_RATE - SERIAL_ACTUAL) * 1000 / SERIAL_RATE)
+
+#if SERIAL_ERROR > SERIAL_MAX_ERROR
+#error "Bit rate error for SERIAL_RATE at CPU_FREQ exceeds SERIAL_MAX_ERROR"
 #endif
 
 /* Data structure used by this module */
 
 static struct serial0_uart uart;
 
+// Wait until cond is true. With SERIAL0_SLEEP, sleep in idle mode
+// between interrupts: the check is made with interrupts off, and
+// sei takes effect after sleep_cpu starts, so no wakeup is lost.
+// SREG is restored afterwards, as the caller had it.
+#ifdef SERIAL0_SLEEP
+#define _wait_until(cond) do { \
+		uint8_t _sreg = SREG; \
+		cli(); \
+		if (cond) { \
+			SREG = _sreg; \
+			break; \
+		} \
+		set_sleep_mode(SLEEP_MODE_IDLE); \
+		sleep_enable(); \
+		sei(); \
+		sleep_cpu(); \
+		sleep_disable(); \
+		SREG = _sreg; \
+	} while (1)
+#else
+#define _wait_until(cond) while (! (cond)) { }
+#endif
+
 /*
 **  Start the timer. The timer must be running while characters
 **  are being received or sent.
@@ -64,7 +125,8 @@ static void _stoptimer(void) {
 **    1 interrupts per data bit
 **    CTC mode (CTC1=1)
 **    No output pin
-**    Frequency = 8000000 / 8 / 104 = 9615 bits/sec
+**    Frequency = CPU_FREQ / PRESCALER_DIVISOR / (SERIAL_TOP + 1)
+**      e.g. 8000000 / 8 / 104 = 9615 bits/sec
 **    Prescaler = 8, Clock source = System clock, OCR0A = 103
 */
 
@@ -148,7 +210,7 @@ uint8_t serial0_startbit(void) {
 
 void serial0_send(unsigned char send_arg) {
 	// Wait until previous byte finished
-	while (! uart.send_ready) { }
+	_wait_until(uart.send_ready);
 
 	OCR0B = TCNT0;
 	uart.send_ready = 0;
@@ -166,12 +228,13 @@ unsigned char serial0_recv(void) {
 
 	if (! uart.available) {
 		if (uart.state == 0) {
-			// Wait for a start bit
+			// Wait for a start bit. This polls the pin, so
+			// it cannot sleep.
 			while (! serial0_startbit()) { }
 		}
 
 		// Wait for rx byte completion
-		while (! uart.available) { }
+		_wait_until(uart.available);
 	}
 
 	c = uart.recv_byte;
@@ -192,7 +255,7 @@ unsigned char serial0_recv(void) {
 
 void serial0_alarm(uint32_t duration) {
 	// Wait until available
-	while (! uart.send_ready) { }
+	_wait_until(uart.send_ready);
 
 	uart.delay = duration;
 	uart.send_ready = 0;
@@ -213,91 +276,109 @@ void serial0_delay(uint32_t duration) {
 	serial0_alarm(duration);
 
 	// Wait until alarm expires
-	while (! uart.send_ready) { }
+	_wait_until(uart.send_ready);
 }
 
 
 // Interrupt routine for timer1, TCCR1A, tx bits
+//
+// states[] gives the code for each uart.state, so every state is
+// reached in the same few cycles rather than after a chain of compares.
+//
+// Cycles from the compare match, with 6 for the interrupt response
+// and vector rjmp, from a clang 14 -Os build; check them against
+// avr-objdump -d serial0.o. The pin is read at cycle 35 and each
+// state is reached at 51. The TX edge comes at 53, or 61 for a data
+// bit, whose level is worked out first. Cycles to the end of the
+// reti:
+//
+//   0 idle             82     5 delay           116-122
+//   1 send_start       94     6 recv_start           90
+//   2 send_bit    106-112     7 recv_bit        98-106
+//   3 send_stop        91     8 recv_stop        96-97
+//   4 send_done        89
 
 ISR(TIMER0_COMPB_vect)
 {
+	static void * const states[] = {
+		&&idle, &&send_start, &&send_bit, &&send_stop, &&send_done,
+		&&delay, &&recv_start, &&recv_bit, &&recv_stop,
+	};
+
 	// Read the bit as early as possible, to try to hit the
 	// center mark
 	uint8_t read_bit = PINB & S0_RX_PIN;
 
-	switch(uart.state) {
-		case 0: // Idle
-			break;
-
-		case 1: // Send start bit
-			PORTB &= ~( S0_TX_PIN );
-			uart.state = 2;
-			uart.bits = 8;
-			break;
-
-		case 2: // Send a bit
-			if (uart.send_byte & 1) {
-				PORTB |= S0_TX_PIN;
-			} else {
-				PORTB &= ~( S0_TX_PIN );
-			}
-			uart.send_byte >>= 1;
-
-			if (! --uart.bits) {
-				uart.state = 3;
-			}
-			break;
-
-		case 3: // Send stop bit
-			PORTB |= S0_TX_PIN;
-			uart.state = 4;
-			break;
-
-		case 4: // Return to idle mode
-			uart.send_ready = 1;
-			uart.state = 0;
-			break;
-
-		case 5: // Timed delay
-			if (! --uart.delay) {
-				uart.send_ready = 1;
-				uart.state = 0;
-			}
-			break;
-
-		case 6: // Midpoint of start bit. Go on to first data bit.
-			uart.state = 7;
-			uart.bits = 8;
-			break;
-
-		case 7: // Reading a data bit
-			uart.recv_shift >>= 1;
-			if (read_bit) {
-				uart.recv_shift |= 0x80;
-			}
-
-			if (! --uart.bits) {
-				uart.state = 8;
-			}
-
-			break;
-
-		case 8: // Reading the stop bit
-			if (read_bit) {
-				uart.recv_byte = uart.recv_shift;
-				uart.available = 1;
-				uart.state = 0;
-				_stoptimer();
-			} else {
-				// Framing error
-				// Would like to wait for next byte at this point (later)
-				uart.recv_byte = 0;
-				uart.available = 2;
-				uart.state = 0;
-				_stoptimer();
-			}
-
-			break;
+	goto *states[uart.state];
 
+send_start: // 1: Send start bit
+	PORTB &= ~( S0_TX_PIN );
+	uart.state = 2;
+	uart.bits = 8;
+	return;
+
+send_bit: // 2: Send a bit
+	if (uart.send_byte & 1) {
+		PORTB |= S0_TX_PIN;
+	} else {
+		PORTB &= ~( S0_TX_PIN );
 	}
+	uart.send_byte >>= 1;
+
+	if (! --uart.bits) {
+		uart.state = 3;
+	}
+	return;
+
+send_stop: // 3: Send stop bit
+	PORTB |= S0_TX_PIN;
+	uart.state = 4;
+	return;
+
+send_done: // 4: Return to idle mode
+	uart.send_ready = 1;
+	uart.state = 0;
+	return;
+
+delay: // 5: Timed delay
+	if (! --uart.delay) {
+		uart.send_ready = 1;
+		uart.state = 0;
+	}
+	return;
+
+recv_start: // 6: Midpoint of start bit. Go on to first data bit.
+	uart.state = 7;
+	uart.bits = 8;
+	return;
+
+recv_bit: // 7: Reading a data bit
+	uart.recv_shift >>= 1;
+	if (read_bit) {
+		uart.recv_shift |= 0x80;
+	}
+
+	if (! --uart.bits) {
+		uart.state = 8;
+	}
+	return;
+
+recv_stop: // 8: Reading the stop bit
+	if (read_bit) {
+		uart.recv_byte = uart.recv_shift;
+		uart.available = 1;
+		uart.state = 0;
+		_stoptimer();
+	} else {
+		// Framing error
+		// Would like to wait for next byte at this point (later)
+		uart.recv_byte = 0;
+		uart.available = 2;
+		uart.state = 0;
+		_stoptimer();
+	}
+	return;
+
+idle: // 0: Idle
+	return;
 }
@@ -9,10 +9,15 @@
 #include <stdint.h>
 
 #ifndef SERIAL_RATE
-// Support for different bitrates is not presently implemented
+// Bits per second. 1200 to 57600 at 8 MHz; 115200 needs CPU_FREQ
+// of 16 MHz. Timer settings are worked out at compile time.
 #define SERIAL_RATE 9600
 #endif
 
+// Define SERIAL0_SLEEP to sleep in idle mode, rather than spin,
+// while waiting for the timer interrupt to finish a byte or delay
+// #define SERIAL0_SLEEP
+
 #define S0_RX_PIN   (1<<PINB2)
 #define S0_TX_PIN   (1<<PORTB3)
 
@@ -0,0 +1,33 @@
+/*
+**  Tullnet Full Duplex Serial UART - host simulator
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Stand-in for <avr/interrupt.h>. ISR() defines a plain function
+**  named after the vector, which fdsim.c calls when the matching
+**  interrupt is pending, enabled and the I bit is set.
+*/
+
+#ifndef _SIM_AVR_INTERRUPT_H
+#define _SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define sei()   (SREG |= 1<<SREG_I)
+#define cli()   (SREG &= ~( 1<<SREG_I ))
+
+#define ISR(vector, ...) void vector(void)
+
+// Vectors in priority order, highest first
+
+void INT0_vect(void);
+void PCINT0_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER1_OVF_vect(void);
+void TIMER0_OVF_vect(void);
+void TIMER1_COMPB_vect(void);
+void TIMER0_COMPA_vect(void);
+void TIMER0_COMPB_vect(void);
+void USI_START_vect(void);
+void USI_OVF_vect(void);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+**  Tullnet Full Duplex Serial UART - host simulator
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Register shim standing in for <avr/io.h> when fd-serial.c is
+**  compiled for the host. Only the ATtiny85 registers and bits
+**  used by the UART modules are provided. The registers are plain
+**  variables defined in fdsim.c, which also steps the timer and
+**  raises the interrupts.
+*/
+
+#ifndef _SIM_AVR_IO_H
+#define _SIM_AVR_IO_H
+
+#include <stdint.h>
+
+// Timer/Counter 1
+
+extern volatile uint8_t TCCR1;
+extern volatile uint8_t TCNT1;
+extern volatile uint8_t OCR1A;
+extern volatile uint8_t OCR1B;
+extern volatile uint8_t OCR1C;
+extern volatile uint8_t GTCCR;
+
+#define CS10    0
+#define CS11    1
+#define CS12    2
+#define CS13    3
+#define COM1A0  4
+#define COM1A1  5
+#define PWM1A   6
+#define CTC1    7
+
+#define PSR1    1
+#define PSR0    0
+
+// Timer/Counter 0
+
+extern volatile uint8_t TCCR0A;
+extern volatile uint8_t TCCR0B;
+extern volatile uint8_t TCNT0;
+extern volatile uint8_t OCR0A;
+extern volatile uint8_t OCR0B;
+
+#define WGM00   0
+#define WGM01   1
+#define COM0B0  4
+#define COM0B1  5
+#define COM0A0  6
+#define COM0A1  7
+
+#define CS00    0
+#define CS01    1
+#define CS02    2
+#define WGM02   3
+
+// Universal Serial Interface. Writing USISR with USIOIF set clears
+// the overflow flag and loads the counter from the low four bits.
+
+extern volatile uint8_t USIDR;
+extern volatile uint8_t USIBR;
+extern volatile uint8_t USISR;
+extern volatile uint8_t USICR;
+
+#define USICNT0 0
+#define USICNT1 1
+#define USICNT2 2
+#define USICNT3 3
+#define USIDC   4
+#define USIPF   5
+#define USIOIF  6
+#define USISIF  7
+
+#define USITC   0
+#define USICLK  1
+#define USICS0  2
+#define USICS1  3
+#define USIWM0  4
+#define USIWM1  5
+#define USIOIE  6
+#define USISIE  7
+
+// Timer interrupt mask and flags. Flags read as zero; writing
+// a one to a flag bit clears the pending interrupt.
+
+extern volatile uint8_t TIMSK;
+extern volatile uint8_t TIFR;
+
+#define TOIE0   1
+#define TOIE1   2
+#define OCIE0B  3
+#define OCIE0A  4
+#define OCIE1B  5
+#define OCIE1A  6
+
+#define TOV0    1
+#define TOV1    2
+#define OCF0B   3
+#define OCF0A   4
+#define OCF1B   5
+#define OCF1A   6
+
+// External interrupts
+
+extern volatile uint8_t GIMSK;
+extern volatile uint8_t GIFR;
+extern volatile uint8_t MCUCR;
+
+#define PCIE    5
+#define INT0    6
+
+#define PCIF    5
+#define INTF0   6
+
+#define ISC00   0
+#define ISC01   1
+#define SM0     3
+#define SM1     4
+#define SE      5
+
+// Port B
+
+extern volatile uint8_t PORTB;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t PINB;
+
+#define PB0     0
+#define PB1     1
+#define PB2     2
+#define PB3     3
+#define PB4     4
+
+#define PORTB0  0
+#define PORTB1  1
+#define PORTB2  2
+#define PORTB3  3
+#define PORTB4  4
+
+#define DDB0    0
+#define DDB1    1
+#define DDB2    2
+#define DDB3    3
+#define DDB4    4
+
+#define PINB0   0
+#define PINB1   1
+#define PINB2   2
+#define PINB3   3
+#define PINB4   4
+
+// General purpose I/O registers
+
+extern volatile uint8_t GPIOR0;
+extern volatile uint8_t GPIOR1;
+extern volatile uint8_t GPIOR2;
+
+// Status register and clock prescaler
+
+extern volatile uint8_t SREG;
+extern volatile uint8_t CLKPR;
+
+#define SREG_I  7
+
+#define CLKPS0  0
+#define CLKPS1  1
+#define CLKPS2  2
+#define CLKPS3  3
+#define CLKPCE  7
+
+#endif
@@ -0,0 +1,29 @@
+/*
+**  Tullnet Full Duplex Serial UART - host simulator
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Stand-in for <avr/sleep.h>. The sleep mode and enable bits are
+**  kept in MCUCR as on the ATtiny85. sleep_cpu() calls fdsim, which
+**  passes simulated time until an interrupt wakes the CPU and runs
+**  its handler.
+*/
+
+#ifndef _SIM_AVR_SLEEP_H
+#define _SIM_AVR_SLEEP_H
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE      0
+#define SLEEP_MODE_ADC       (1<<SM0)
+#define SLEEP_MODE_PWR_DOWN  (1<<SM1)
+
+extern volatile unsigned long sim_sleeps;
+void sim_sleep(void);
+
+#define set_sleep_mode(mode) \
+	(MCUCR = (MCUCR & ~( 1<<SM1 | 1<<SM0 )) | (mode))
+#define sleep_enable()  (MCUCR |= 1<<SE)
+#define sleep_disable() (MCUCR &= ~( 1<<SE ))
+#define sleep_cpu()     sim_sleep()
+
+#endif
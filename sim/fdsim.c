@@ -0,0 +1,1013 @@
+/*
+**  Tullnet Full Duplex Serial UART - host simulator
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Discrete-event driver for fd-serial.c compiled on the host.
+**  Every CPU cycle it:
+**    steps Timer/Counter 1 (prescaler, CTC on OCR1C, compare flags)
+**    steps Timer/Counter 0, which can clock the USI shift register
+**    drives PB2 from a virtual UART peer, which also decodes TX
+**    latches INT0 edges according to MCUCR
+**    runs the highest priority pending interrupt, or the main loop
+**
+**  An ISR runs to completion instantly and then keeps the CPU busy
+**  for a fixed number of cycles (-i), during which other interrupts
+**  stay pending. A main loop pass likewise takes -m cycles, but
+**  interrupts are taken while it runs. sleep_cpu() passes simulated
+**  time until an interrupt wakes the CPU; in power-down the timers
+**  stop and the wake-up takes -W cycles more.
+**
+**  The main loop is example-recv: receive a byte, echo it back
+**  (or with -b, as many bytes as have arrived).
+**  The peer sends a numbered byte stream at the given rate and
+**  checks what comes back, giving sustained full-duplex throughput,
+**  RX latency (peer stop bit start to fdserial_recv() return) and
+**  the number of bytes dropped by the receiver.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "fd-serial.h"
+
+#ifndef CPU_FREQ
+#define CPU_FREQ 8000000
+#endif
+
+/* Register file */
+
+volatile uint8_t TCCR1, TCNT1, OCR1A, OCR1B, OCR1C, GTCCR;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B;
+volatile uint8_t TIMSK, TIFR, GIMSK, GIFR, MCUCR;
+volatile uint8_t PORTB, DDRB, PINB;
+volatile uint8_t SREG, CLKPR;
+volatile uint8_t USIDR, USIBR, USISR, USICR;
+volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+volatile unsigned long sim_sleeps;
+
+/* Vectors not defined by the code under test */
+
+__attribute__((weak)) void INT0_vect(void) { }
+__attribute__((weak)) void PCINT0_vect(void) { }
+__attribute__((weak)) void TIMER1_COMPA_vect(void) { }
+__attribute__((weak)) void TIMER1_OVF_vect(void) { }
+__attribute__((weak)) void TIMER0_OVF_vect(void) { }
+__attribute__((weak)) void TIMER1_COMPB_vect(void) { }
+__attribute__((weak)) void TIMER0_COMPA_vect(void) { }
+__attribute__((weak)) void TIMER0_COMPB_vect(void) { }
+__attribute__((weak)) void USI_START_vect(void) { }
+__attribute__((weak)) void USI_OVF_vect(void) { }
+
+/* Pending interrupt flags, as TIFR and GIFR would read on the chip */
+
+static uint8_t tifr;
+static uint8_t gifr;
+static uint8_t usi_oif;
+
+/* Interrupts taken, per vector */
+
+static struct {
+	long int0;
+	long compa;
+	long compb;
+	long usi_ovf;
+} isr_count;
+
+static uint64_t now;          // CPU cycle count
+static uint16_t t1_prescale;  // CPU cycles since the last timer 1 tick
+static uint16_t t0_prescale;  // CPU cycles since the last timer 0 tick
+static uint64_t t1_running;   // CPU cycles with timer 1 clocked
+static uint8_t int0_level = 1;
+static uint64_t sim_end;      // give up at this cycle
+static int isr_busy;          // CPU cycles left in the last interrupt
+static uint64_t pd_cycles;    // CPU cycles spent in power-down
+static long pd_wakeups;
+
+/* Run-time options */
+
+static double opt_rate = SERIAL_RATE;  // peer bits/sec
+static long opt_bytes = 1000;          // bytes injected by the peer
+static double opt_gap = 0;             // idle bit times between frames
+static long opt_ppm = 0;               // peer clock error
+static int opt_isr = 40;               // cycles per interrupt
+static int opt_main = 20;              // cycles per main loop pass
+static int opt_bulk = 0;               // echo with tryread/trywrite
+static int opt_set_rate = 0;           // fdserial_set_rate() to the peer rate
+static int opt_autobaud = 0;           // lock on to a leading 'U' first
+static long opt_badstop = 0;           // every Nth frame has a low stop bit
+static int opt_break = 0;              // frame 0 is a break this many bits long
+static long opt_badparity = 0;         // every Nth frame has the wrong parity
+static int opt_node = -1;              // our address on a 4 node bus
+static int opt_powerdown = 0;          // fdserial_powerdown() when idle
+static long opt_alarm = 0;             // ms for alarm 0, twice that for 1...
+static long opt_timeout = 0;           // fdserial_recv_timeout() bit times
+static int opt_idle = 0;               // fdserial_read_idle() character times
+static long opt_packet = 0;            // bytes per packet, 4 characters apart
+static long opt_line = 0;              // bytes per line, delimiter included
+#ifdef FDSERIAL_WAKEUP_CYCLES
+static int opt_wake = FDSERIAL_WAKEUP_CYCLES; // cycles to wake from power-down
+#else
+static int opt_wake = 10;
+#endif
+static int opt_verbose = 0;
+
+/* The frame format, as configured in fd-serial.h, which also gives
+** FRAME_BITS and FRAME_PARITY_BITS */
+
+#define DATA_MASK ((1 << SERIAL_DATA_BITS) - 1)
+#define STOP_MASK (((1 << SERIAL_STOP_BITS) - 1) << (SERIAL_DATA_BITS + FRAME_PARITY_BITS))
+
+/* The peer's transmitter, driving PB2 */
+
+static struct {
+	double period;       // CPU cycles per bit
+	long sent;           // frames started
+} ptx;
+
+/* The peer's receiver, decoding TX */
+
+static struct {
+	uint8_t busy;
+	double start;        // cycle of the start bit falling edge
+	uint8_t bit;         // next bit to sample
+	uint16_t shift;      // bits after the start bit
+	uint8_t last_level;
+	long decoded;
+	long framing;
+	long mismatched;
+	double max_edge;     // worst edge misplacement, in cycles
+	uint64_t first;      // cycle of the first start bit
+	uint64_t last_stop;  // cycle at which the last stop bit was sampled
+} prx;
+
+/* The application under test, and what it has seen */
+
+static struct {
+	uint8_t have;        // bytes held to echo
+	uint8_t sent;        // of which already sent
+	fd_char_t buf[64];
+	long received;
+	long dropped;
+	long corrupt;
+	long next;           // index of the next unmatched peer frame
+	uint64_t lat_min;
+	uint64_t lat_max;
+	uint64_t lat_sum;
+	fd_char_t *echoed;
+	long nechoed;
+	uint32_t locked;     // rate found by autobaud
+	uint8_t errors;      // every FDSERIAL_ERR_ bit seen
+	uint8_t alarm[FDSERIAL_ALARMS];     // numbers from fdserial_alarm()
+	uint64_t alarm_set[FDSERIAL_ALARMS]; // cycle each was set
+	uint8_t alarm_running; // one bit per alarm set
+	long alarms;         // alarms seen to expire
+	long timeouts;       // fdserial_recv_timeout() returns of -1
+	long packets;        // fdserial_read_idle(), fdserial_get_frame() or
+	                     // fdserial_readline() returns
+	double alarm_min;    // earliest and latest, in cycles after due
+	double alarm_max;
+} app;
+
+static fd_char_t frame_value(long i) {
+	if (opt_autobaud && i == 0) {
+		return 'U';
+	}
+	if (opt_break && i == 0) {
+		return 0;
+	}
+	if (opt_node >= 0) {
+		// Every 8th frame addresses the next of nodes 0-3
+		return i % 8 ? i & 0xff : 0x100 | (i / 8 % 4);
+	}
+#ifdef FDSERIAL_DELIMITER
+	if (opt_line) {
+		// Letters, with the delimiter ending each line
+		return (i + 1) % opt_line ? 'a' + i % 26 : FDSERIAL_DELIMITER;
+	}
+#endif
+	return i & DATA_MASK;
+}
+
+// Is frame i meant for us?
+
+static int frame_wanted(long i) {
+	return opt_node < 0 || i / 8 % 4 == opt_node;
+}
+
+static long frames_wanted(long from, long to) {
+	long n = 0;
+
+	for (; from < to; ++from) {
+		n += frame_wanted(from);
+	}
+
+	return n;
+}
+
+/*
+**  The bits of a frame after the start bit, first bit in bit 0:
+**  data bits, parity bit, stop bits.
+*/
+
+static uint16_t frame_bits(fd_char_t c) {
+	uint16_t bits = c & DATA_MASK;
+
+	if (FRAME_PARITY_BITS) {
+		int p = __builtin_parity(bits) ^ (SERIAL_PARITY == SERIAL_PARITY_ODD);
+
+		bits |= p << SERIAL_DATA_BITS;
+	}
+
+	return bits | STOP_MASK;
+}
+
+// Leave the line idle for two frames before the peer starts
+
+static double frame_start(long i) {
+	if (opt_break && i > 0) {
+		// The break runs on past the end of frame 0, and is
+		// followed by at least one idle bit
+		i += opt_break / FRAME_BITS;
+	}
+	return ptx.period * (FRAME_BITS * 2 + (FRAME_BITS + opt_gap) * i +
+		(opt_packet ? i / opt_packet * FRAME_BITS * 4 : 0));
+}
+
+// The first stop bit, which the receiver samples
+
+static double stop_bit_time(long i) {
+	return frame_start(i) + ptx.period * (FRAME_BITS - SERIAL_STOP_BITS);
+}
+
+/*
+**  Step timer 1 by one CPU cycle.
+*/
+
+static void timer1_cycle(void) {
+	uint8_t cs = TCCR1 & ( 1<<CS13 | 1<<CS12 | 1<<CS11 | 1<<CS10 );
+
+	// PSR1 resets the prescaler and clears itself
+	if (GTCCR & 1<<PSR1) {
+		GTCCR &= ~( 1<<PSR1 );
+		t1_prescale = 0;
+	}
+
+	if (! cs) {
+		return;
+	}
+
+	t1_running ++;
+
+	if (++t1_prescale < (1U << (cs - 1))) {
+		return;
+	}
+
+	t1_prescale = 0;
+
+	if ((TCCR1 & 1<<CTC1) && TCNT1 == OCR1C) {
+		TCNT1 = 0;
+	} else if (TCNT1 == 0xff) {
+		TCNT1 = 0;
+		tifr |= 1<<TOV1;
+	} else {
+		TCNT1 ++;
+	}
+
+	if (TCNT1 == OCR1A) {
+		tifr |= 1<<OCF1A;
+	}
+
+	if (TCNT1 == OCR1B) {
+		tifr |= 1<<OCF1B;
+	}
+}
+
+/*
+**  Clock the USI once: shift DI into USIDR and count, setting the
+**  overflow flag as the 4-bit counter wraps.
+*/
+
+static void usi_clock(void) {
+	USIDR = USIDR << 1 | ((PINB >> PINB0) & 1);
+	USISR = (USISR + 1) & 0x0f;
+
+	if (! USISR) {
+		usi_oif = 1;
+	}
+}
+
+/*
+**  Step timer 0 by one CPU cycle. A compare match on OCR0A also
+**  clocks the USI, when that is its clock source.
+*/
+
+static void timer0_cycle(void) {
+	static const uint16_t divisor[] = { 0, 1, 8, 64, 256, 1024 };
+	uint8_t cs = TCCR0B & ( 1<<CS02 | 1<<CS01 | 1<<CS00 );
+
+	if (! cs || cs > 5) {
+		return;
+	}
+
+	if (++t0_prescale < divisor[cs]) {
+		return;
+	}
+
+	t0_prescale = 0;
+
+	if ((TCCR0A & 1<<WGM01) && TCNT0 == OCR0A) {
+		TCNT0 = 0;
+	} else {
+		TCNT0 ++;
+	}
+
+	if (TCNT0 == OCR0A) {
+		tifr |= 1<<OCF0A;
+		if ((USICR & ( 1<<USICS1 | 1<<USICS0 )) == 1<<USICS0) {
+			usi_clock();
+		}
+	}
+}
+
+/*
+**  The level on the TX line: PB3, or with FDSERIAL_USI_TX, PB1
+**  which the USI drives from the top bit of USIDR in three-wire mode.
+*/
+
+static uint8_t tx_level(void) {
+#ifdef FDSERIAL_USI_TX
+	if (! (DDRB & 1<<DDB1)) {
+		return 1;
+	}
+	if ((USICR & ( 1<<USIWM1 | 1<<USIWM0 )) == 1<<USIWM0) {
+		return USIDR >> 7;
+	}
+	return (PORTB >> PORTB1) & 1;
+#else
+	return (DDRB & 1<<DDB3) ? (PORTB >> PORTB3) & 1 : 1;
+#endif
+}
+
+/*
+**  Drive PB2 from the peer transmitter.
+*/
+
+static void peer_tx_cycle(void) {
+	uint8_t level = 1;
+
+	while (ptx.sent < opt_bytes && now >= frame_start(ptx.sent)) {
+		ptx.sent ++;
+	}
+
+	if (ptx.sent) {
+		double t = now - frame_start(ptx.sent - 1);
+
+		if (opt_break && ptx.sent == 1) {
+			level = t >= ptx.period * opt_break;
+		} else if (t < ptx.period * FRAME_BITS) {
+			int bit = t / ptx.period;
+			uint16_t bits = frame_bits(frame_value(ptx.sent - 1));
+
+			if (bit == 0) {
+				level = 0;
+			} else if (bit <= SERIAL_DATA_BITS + FRAME_PARITY_BITS) {
+				level = (bits >> (bit - 1)) & 1;
+				if (bit > SERIAL_DATA_BITS && opt_badparity &&
+					ptx.sent % opt_badparity == 0) {
+					level ^= 1;
+				}
+			} else if (opt_badstop && ptx.sent % opt_badstop == 0) {
+				level = 0;
+			}
+		}
+	}
+
+	if (level) {
+		PINB |= 1<<PINB2;
+	} else {
+		PINB &= ~( 1<<PINB2 );
+	}
+}
+
+/*
+**  Decode TX with the peer receiver, and check the echoed bytes.
+*/
+
+static void peer_rx_cycle(void) {
+	uint8_t level = tx_level();
+
+	if (level != prx.last_level && prx.busy) {
+		double t = now - prx.start;
+		double edge = t - ptx.period * (long) (t / ptx.period + 0.5);
+
+		if (edge < 0) {
+			edge = -edge;
+		}
+		if (edge > prx.max_edge) {
+			prx.max_edge = edge;
+		}
+	}
+
+	if (! prx.busy) {
+		if (prx.last_level && ! level) {
+			prx.busy = 1;
+			prx.start = now;
+			if (! prx.decoded) {
+				prx.first = now;
+			}
+			prx.bit = 0;
+			prx.shift = 0;
+		}
+	} else if (now >= prx.start + ptx.period * (prx.bit + 0.5)) {
+		if (prx.bit == 0) {
+			if (level) {
+				// Glitch, not a start bit
+				prx.busy = 0;
+			}
+		} else if (prx.bit < FRAME_BITS - 1) {
+			if (level) {
+				prx.shift |= 1 << (prx.bit - 1);
+			}
+		} else {
+			// Check every stop bit, not just the first
+			if (level) {
+				prx.shift |= 1 << (prx.bit - 1);
+			}
+			if ((prx.shift & STOP_MASK) != STOP_MASK) {
+				prx.framing ++;
+			} else if (prx.decoded >= app.nechoed ||
+				prx.shift != frame_bits(app.echoed[prx.decoded])) {
+				prx.mismatched ++;
+			}
+			prx.decoded ++;
+			prx.last_stop = now;
+			prx.busy = 0;
+		}
+		prx.bit ++;
+	}
+
+	prx.last_level = level;
+}
+
+/*
+**  Latch INT0 according to the sense control bits in MCUCR.
+*/
+
+static void int0_cycle(void) {
+	uint8_t level = (PINB >> PINB2) & 1;
+
+	switch (MCUCR & ( 1<<ISC01 | 1<<ISC00 )) {
+		case 0: // Low level
+			if (! level) {
+				gifr |= 1<<INTF0;
+			}
+			break;
+
+		case 1<<ISC00: // Any change
+			if (level != int0_level) {
+				gifr |= 1<<INTF0;
+			}
+			break;
+
+		case 1<<ISC01: // Falling edge
+			if (int0_level && ! level) {
+				gifr |= 1<<INTF0;
+			}
+			break;
+
+		default: // Rising edge
+			if (! int0_level && level) {
+				gifr |= 1<<INTF0;
+			}
+			break;
+	}
+
+	int0_level = level;
+}
+
+/*
+**  Step the hardware one CPU cycle. The timers are not clocked in
+**  power-down.
+*/
+
+static void hw_cycle(int clocked) {
+	if (clocked) {
+		timer1_cycle();
+		timer0_cycle();
+	}
+	peer_tx_cycle();
+	int0_cycle();
+	peer_rx_cycle();
+}
+
+/*
+**  Run one interrupt handler as the CPU would: I bit cleared on
+**  entry, set again by reti. Writes to the flag registers clear
+**  the pending flags.
+*/
+
+static void run_isr(void (*isr)(void)) {
+	SREG &= ~( 1<<SREG_I );
+	isr();
+	SREG |= 1<<SREG_I;
+}
+
+static void clear_flags(void) {
+	tifr &= ~TIFR;
+	TIFR = 0;
+	if (USISR & 1<<USIOIF) {
+		usi_oif = 0;
+		USISR &= 0x0f;
+	}
+	gifr &= ~GIFR;
+	GIFR = 0;
+}
+
+static int interrupt_pending(void) {
+	return (SREG & 1<<SREG_I) && (
+		((gifr & 1<<INTF0) && (GIMSK & 1<<INT0)) ||
+		((tifr & 1<<OCF1A) && (TIMSK & 1<<OCIE1A)) ||
+		((tifr & 1<<TOV1) && (TIMSK & 1<<TOIE1)) ||
+		((tifr & 1<<OCF1B) && (TIMSK & 1<<OCIE1B)) ||
+		(usi_oif && (USICR & 1<<USIOIE)));
+}
+
+static int dispatch(void) {
+	if (! (SREG & 1<<SREG_I)) {
+		return 0;
+	}
+
+	if ((gifr & 1<<INTF0) && (GIMSK & 1<<INT0)) {
+		gifr &= ~( 1<<INTF0 );
+		run_isr(INT0_vect);
+		isr_count.int0 ++;
+	} else if ((tifr & 1<<OCF1A) && (TIMSK & 1<<OCIE1A)) {
+		tifr &= ~( 1<<OCF1A );
+		run_isr(TIMER1_COMPA_vect);
+		isr_count.compa ++;
+	} else if ((tifr & 1<<TOV1) && (TIMSK & 1<<TOIE1)) {
+		tifr &= ~( 1<<TOV1 );
+		run_isr(TIMER1_OVF_vect);
+	} else if ((tifr & 1<<OCF1B) && (TIMSK & 1<<OCIE1B)) {
+		tifr &= ~( 1<<OCF1B );
+		run_isr(TIMER1_COMPB_vect);
+		isr_count.compb ++;
+	} else if (usi_oif && (USICR & 1<<USIOIE)) {
+		// USIOIF stays set until the handler writes USISR
+		run_isr(USI_OVF_vect);
+		isr_count.usi_ovf ++;
+	} else {
+		return 0;
+	}
+
+	clear_flags();
+	return 1;
+}
+
+/*
+**  sleep_cpu(): pass simulated time until an interrupt is pending,
+**  then run its handler, as the CPU does before going on from the
+**  sleep instruction. Only INT0 can wake the CPU from power-down,
+**  and its handler runs opt_wake cycles after the level is seen.
+*/
+
+void sim_sleep(void) {
+	int power_down = (MCUCR & ( 1<<SM1 | 1<<SM0 )) == SLEEP_MODE_PWR_DOWN;
+	int i;
+
+	if (! (MCUCR & 1<<SE)) {
+		return;
+	}
+	sim_sleeps ++;
+
+	while (! interrupt_pending()) {
+		if (++now >= sim_end) {
+			fprintf(stderr, "fdsim: asleep at the end of the run\n");
+			exit(1);
+		}
+		hw_cycle(! power_down);
+		if (power_down) {
+			pd_cycles ++;
+			// The peer has finished: stand in for a watchdog wake-up
+			if (now > stop_bit_time(opt_bytes - 1) + ptx.period) {
+				return;
+			}
+		}
+	}
+
+	if (power_down) {
+		pd_wakeups ++;
+		for (i = 0; i < opt_wake; ++i) {
+			++now;
+			hw_cycle(0);
+		}
+		pd_cycles += opt_wake;
+	}
+
+	dispatch();
+	for (i = 1; i < opt_isr; ++i) {
+		++now;
+		hw_cycle(1);
+	}
+}
+
+/*
+**  Match a received byte against the frames the peer has sent,
+**  counting any frames skipped over as dropped.
+*/
+
+static void app_received(fd_char_t c) {
+	long i;
+
+	for (i = app.next; i < ptx.sent && i < app.next + 256 &&
+		stop_bit_time(i) <= now; ++i) {
+		if (frame_wanted(i) && frame_value(i) == c) {
+			uint64_t lat = now - (uint64_t) stop_bit_time(i);
+
+			app.dropped += frames_wanted(app.next, i);
+			app.next = i + 1;
+			app.received ++;
+			app.lat_sum += lat;
+			if (! app.lat_min || lat < app.lat_min) {
+				app.lat_min = lat;
+			}
+			if (lat > app.lat_max) {
+				app.lat_max = lat;
+			}
+			if (opt_verbose) {
+				printf("rx %ld 0x%02x latency %.1f us\n", i, c,
+					lat * 1e6 / CPU_FREQ);
+			}
+			return;
+		}
+	}
+
+	app.corrupt ++;
+}
+
+/*
+**  Keep every alarm running, alarm i for (i + 1) * opt_alarm ms, and
+**  time each one from being set to being seen to expire.
+*/
+
+static void run_alarms(void) {
+	uint8_t i;
+
+	for (i = 0; i < FDSERIAL_ALARMS; ++i) {
+		uint32_t ms = opt_alarm * (i + 1);
+
+		if (app.alarm_running & 1<<i) {
+			double late;
+
+			if (! fdserial_alarm_expired(app.alarm[i])) {
+				continue;
+			}
+			late = (now - app.alarm_set[i]) - ms * (CPU_FREQ / 1000.0);
+			if (! app.alarms || late < app.alarm_min) {
+				app.alarm_min = late;
+			}
+			if (! app.alarms || late > app.alarm_max) {
+				app.alarm_max = late;
+			}
+			app.alarms ++;
+		}
+
+		app.alarm[i] = fdserial_alarm(ms);
+		app.alarm_set[i] = now;
+		app.alarm_running |= 1<<i;
+	}
+}
+
+/*
+**  One pass of the main loop. Only calls that cannot block are made,
+**  since nothing would advance simulated time while they spin. With
+**  -P each pass ends in fdserial_powerdown(), which sleeps, and -o
+**  and -I wait in calls which sleep under FDSERIAL_SLEEP.
+*/
+
+static void main_loop(void) {
+	uint8_t i;
+
+#ifdef FDSERIAL_AUTOBAUD
+	if (opt_autobaud && ! app.locked) {
+		app.locked = fdserial_autobaud_rate();
+		if (app.locked) {
+			// The sync character is not echoed
+			app.next = 1;
+			if (opt_verbose) {
+				printf("autobaud %lu bps\n", (unsigned long) app.locked);
+			}
+		}
+		return;
+	}
+#endif
+
+	if (opt_alarm) {
+		run_alarms();
+	}
+
+	if (! app.have) {
+		app.errors |= fdserial_errors();
+
+#ifdef FDSERIAL_FRAMES
+		// Every byte belongs to a frame, so read nothing else
+		if (fdserial_frames()) {
+			uint8_t n = fdserial_get_frame(app.buf, sizeof(app.buf));
+
+			app.have = n < sizeof(app.buf) ? n : sizeof(app.buf);
+			app.packets ++;
+		}
+#else
+		if (opt_line) {
+#ifdef FDSERIAL_DELIMITER
+			// What fdserial_readline() would wait for
+			if (fdserial_lines() || fdserial_available() == RING_BUFFER) {
+				app.have = fdserial_readline(app.buf, sizeof(app.buf));
+				app.packets ++;
+			}
+#endif
+		} else if (opt_idle) {
+			// Never waits for the first byte, which may not come
+			if (fdserial_available()) {
+				app.have = fdserial_read_idle(app.buf, sizeof(app.buf), opt_idle);
+				app.packets ++;
+			}
+		} else if (opt_timeout) {
+			int16_t c = fdserial_recv_timeout(opt_timeout);
+
+			if (c < 0) {
+				app.timeouts ++;
+			} else {
+				app.buf[0] = c;
+				app.have = 1;
+			}
+		} else if (opt_bulk) {
+			app.have = fdserial_tryread(app.buf, sizeof(app.buf));
+		} else if (fdserial_available()) {
+			app.buf[0] = fdserial_recv();
+			app.have = 1;
+		}
+#endif
+
+		for (i = 0; i < app.have; ++i) {
+			app_received(app.buf[i]);
+		}
+		app.sent = 0;
+	}
+
+	if (app.have) {
+		uint8_t n = 0;
+
+		if (opt_bulk) {
+			n = fdserial_trywrite(app.buf + app.sent, app.have - app.sent);
+		} else if (fdserial_sendok()) {
+			fdserial_send(app.buf[app.sent]);
+			n = 1;
+		}
+
+		for (i = 0; i < n; ++i) {
+			app.echoed[app.nechoed++] = app.buf[app.sent++];
+		}
+		if (app.sent == app.have) {
+			app.have = 0;
+		}
+	}
+
+#ifdef FDSERIAL_POWER_DOWN
+	// Nothing to do until the peer's next frame
+	if (opt_powerdown && ! app.have && ! fdserial_available() &&
+		ptx.sent < opt_bytes) {
+		fdserial_powerdown();
+	}
+#endif
+}
+
+static void usage(void) {
+	fprintf(stderr,
+		"usage: fdsim [-r rate] [-n bytes] [-g gap] [-e ppm] [-i cycles] [-m cycles] [-b] [-s] [-a] [-x n] [-k bits] [-p n] [-A addr] [-P] [-W cycles] [-t ms] [-o bits] [-I chars] [-f n] [-L n] [-v] [-h]\n"
+		"  -r  peer bit rate (default %d)\n"
+		"  -n  number of bytes the peer sends (default 1000)\n"
+		"  -g  idle bit times between peer frames (default 0)\n"
+		"  -e  peer clock error in ppm (default 0)\n"
+		"  -i  CPU cycles taken by each interrupt (default 40)\n"
+		"  -m  CPU cycles taken by each main loop pass (default 20)\n"
+		"  -b  echo with fdserial_tryread() and fdserial_trywrite()\n"
+		"  -s  switch to the peer rate with fdserial_set_rate()\n"
+		"  -a  send 'U' first and find the rate with fdserial_autobaud_start()\n"
+		"  -x  send every nth frame with a low stop bit\n"
+		"  -k  start with a break of this many bit times\n"
+		"  -p  send every nth frame with the wrong parity bit\n"
+		"  -A  address the stream to nodes 0-3 in turn; receive as node addr\n"
+		"  -P  sleep with fdserial_powerdown() between frames\n"
+		"  -W  CPU cycles to wake from power-down (default %d)\n"
+		"  -t  keep %d alarms running, of ms, 2 * ms and so on\n"
+		"  -o  receive with fdserial_recv_timeout() of this many bit times\n"
+		"  -I  receive packets with fdserial_read_idle() of this many characters\n"
+		"  -f  send packets of n bytes, 4 character times apart\n"
+		"  -L  send lines of n bytes and receive them with fdserial_readline()\n"
+		"  -v  report every byte\n"
+		"  -h  print this list\n", SERIAL_RATE, opt_wake, FDSERIAL_ALARMS);
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	int ch;
+	int main_busy = 0;
+	double elapsed;
+
+	while ((ch = getopt(argc, argv, "r:n:g:e:i:m:bsax:k:p:A:PW:t:o:I:f:L:vh")) != -1) {
+		switch (ch) {
+			case 'r': opt_rate = atof(optarg); break;
+			case 'n': opt_bytes = atol(optarg); break;
+			case 'g': opt_gap = atof(optarg); break;
+			case 'e': opt_ppm = atol(optarg); break;
+			case 'i': opt_isr = atoi(optarg); break;
+			case 'm': opt_main = atoi(optarg); break;
+			case 'b': opt_bulk = 1; break;
+			case 's': opt_set_rate = 1; break;
+			case 'a': opt_autobaud = 1; break;
+			case 'x': opt_badstop = atol(optarg); break;
+			case 'k': opt_break = atoi(optarg); break;
+			case 'p': opt_badparity = atol(optarg); break;
+			case 'A': opt_node = atoi(optarg); break;
+			case 'P': opt_powerdown = 1; break;
+			case 'W': opt_wake = atoi(optarg); break;
+			case 't': opt_alarm = atol(optarg); break;
+			case 'o': opt_timeout = atol(optarg); break;
+			case 'I': opt_idle = atoi(optarg); break;
+			case 'f': opt_packet = atol(optarg); break;
+			case 'L': opt_line = atol(optarg); break;
+			case 'v': opt_verbose = 1; break;
+			case 'h': usage();
+			default: usage();
+		}
+	}
+
+	if (opt_rate <= 0 || opt_bytes <= 0 || opt_gap < 0 || opt_break < 0 ||
+		(opt_break && opt_autobaud) || opt_wake < 0 || opt_alarm < 0 ||
+		opt_timeout < 0 || opt_idle < 0 || opt_packet < 0 ||
+		opt_line < 0) {
+		usage();
+	}
+
+	if (opt_timeout || opt_idle) {
+#ifndef FDSERIAL_SLEEP
+		// Their waits would spin without passing simulated time
+		fprintf(stderr, "fdsim: -o and -I need FDSERIAL_SLEEP\n");
+		return 1;
+#endif
+	}
+
+	if (opt_line) {
+#ifndef FDSERIAL_DELIMITER
+		fprintf(stderr, "fdsim: built without FDSERIAL_DELIMITER\n");
+		return 1;
+#endif
+	}
+
+	if (opt_powerdown) {
+#ifndef FDSERIAL_POWER_DOWN
+		fprintf(stderr, "fdsim: built without FDSERIAL_POWER_DOWN\n");
+		return 1;
+#endif
+	}
+
+	ptx.period = CPU_FREQ / opt_rate * (1.0 - opt_ppm / 1e6);
+	prx.last_level = 1;
+	app.echoed = malloc(opt_bytes * sizeof(*app.echoed));
+	if (! app.echoed) {
+		perror("malloc");
+		return 1;
+	}
+
+	PINB = 0xff;
+	fdserial_init();
+	clear_flags();
+	sei();
+
+	if (opt_set_rate && ! fdserial_set_rate(opt_rate)) {
+		fprintf(stderr, "fdsim: fdserial_set_rate(%.0f) failed\n", opt_rate);
+		return 1;
+	}
+
+	// fdserial_alarm() times at most 32766 bit times
+	if (fdserial_ms_to_ticks(opt_alarm * FDSERIAL_ALARMS) > 32766) {
+		fprintf(stderr, "fdsim: -t %ld is too long for %d alarms at this rate\n",
+			opt_alarm, FDSERIAL_ALARMS);
+		return 1;
+	}
+
+	if (opt_node >= 0) {
+#ifdef FDSERIAL_ADDRESS
+		fdserial_set_address(opt_node);
+#else
+		fprintf(stderr, "fdsim: built without FDSERIAL_ADDRESS\n");
+		return 1;
+#endif
+	}
+
+	if (opt_autobaud) {
+#ifdef FDSERIAL_AUTOBAUD
+		fdserial_autobaud_start();
+#else
+		fprintf(stderr, "fdsim: built without FDSERIAL_AUTOBAUD\n");
+		return 1;
+#endif
+	}
+
+	if (opt_break) {
+		// The break itself is not a byte
+		app.next = 1;
+	}
+
+	// Run on until the echo has drained, or give up a while later
+	sim_end = (uint64_t) (stop_bit_time(opt_bytes) +
+		ptx.period * (FRAME_BITS * 1000 + opt_timeout));
+
+	for (now = 0; now < sim_end; ++now) {
+		// fdserial_sendok() only means the TX ring has room, so wait
+		// for every byte queued to have come out on the line
+		if (now > stop_bit_time(opt_bytes) + ptx.period * FRAME_BITS * 2 &&
+			! app.have && ! fdserial_available() &&
+			prx.decoded >= app.nechoed && ! prx.busy) {
+			break;
+		}
+
+		hw_cycle(1);
+
+		if (isr_busy) {
+			isr_busy --;
+		} else if (dispatch()) {
+			isr_busy = opt_isr - 1;
+		} else if (main_busy) {
+			main_busy --;
+		} else {
+			main_loop();
+			clear_flags();
+			main_busy = opt_main - 1;
+		}
+	}
+
+	elapsed = (stop_bit_time(opt_bytes - 1) + ptx.period - frame_start(0)) / CPU_FREQ;
+
+	printf("fdsim: %d Hz, peer %.0f bps %+ld ppm, %ld bytes, gap %.1f bits\n",
+		CPU_FREQ, opt_rate, opt_ppm, opt_bytes, opt_gap);
+	if (opt_autobaud) {
+		printf("autobaud: %lu bps\n", (unsigned long) app.locked);
+	}
+	printf("rx: %ld received, %ld dropped, %ld corrupt\n",
+		app.received, app.dropped + frames_wanted(app.next, ptx.sent), app.corrupt);
+	printf("rx errors: 0x%02x, %u overflows, %u framing, %u breaks, %u parity\n",
+		app.errors | fdserial_errors(), fdserial_overflows(),
+		fdserial_frame_errors(), fdserial_breaks(),
+		fdserial_parity_errors());
+	if (app.received) {
+		printf("rx latency (us): min %.1f avg %.1f max %.1f\n",
+			app.lat_min * 1e6 / CPU_FREQ,
+			app.lat_sum * 1e6 / CPU_FREQ / app.received,
+			app.lat_max * 1e6 / CPU_FREQ);
+	}
+	printf("tx: %ld echoed, %ld decoded, %ld framing errors, %ld mismatched\n",
+		app.nechoed, prx.decoded, prx.framing, prx.mismatched);
+	printf("tx edge error: max %.1f%% of a bit\n",
+		prx.max_edge * 100 / ptx.period);
+	printf("interrupts: INT0 %ld, TIMER1_COMPA %ld, TIMER1_COMPB %ld, USI_OVF %ld\n",
+		isr_count.int0, isr_count.compa, isr_count.compb, isr_count.usi_ovf);
+	printf("timer1 running: %.1f%% of %llu cycles\n",
+		t1_running * 100.0 / now, (unsigned long long) now);
+	if (opt_timeout) {
+		printf("timeouts: %ld\n", app.timeouts);
+	}
+	if (opt_idle || app.packets) {
+		printf("packets: %ld, %.1f bytes each\n", app.packets,
+			app.packets ? (double) app.received / app.packets : 0.0);
+	}
+	if (app.alarms) {
+		printf("alarms: %ld expired, %.1f to %.1f us after due\n",
+			app.alarms, app.alarm_min * 1e6 / CPU_FREQ,
+			app.alarm_max * 1e6 / CPU_FREQ);
+	}
+#ifdef FDSERIAL_TICKS
+	printf("ticks: %lu, %lu ms, %lu us, at %.0f us\n",
+		(unsigned long) fdserial_ticks(), (unsigned long) fdserial_millis(),
+		(unsigned long) fdserial_micros(), now * 1e6 / CPU_FREQ);
+#endif
+	if (sim_sleeps) {
+		printf("sleeps: %lu\n", sim_sleeps);
+	}
+	if (opt_powerdown) {
+		printf("power-down: %.1f%% of cycles, %ld wakeups\n",
+			pd_cycles * 100.0 / now, pd_wakeups);
+	}
+	printf("throughput (bytes/s): rx %.1f tx %.1f\n",
+		app.received / elapsed,
+		prx.decoded / ((double) (prx.last_stop - prx.first) / CPU_FREQ));
+
+	return 0;
+}
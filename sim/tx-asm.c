@@ -0,0 +1,52 @@
+/*
+**  Tullnet Full Duplex Serial UART - host simulator
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Stand-in for fd-serial-tx.S when fdsim is built with
+**  FDSERIAL_ASM_TX: the same steps in C, one statement per few
+**  instructions, so the GPIOR state handling in fd-serial.c can be
+**  run against the simulated peer.
+**
+**  Being C, it does not check the assembler's arithmetic: macros
+**  from fd-serial.h are worked out here by the compiler, which can
+**  differ from what the assembler makes of them (a true comparison
+**  is 1 here and -1 there). Check fd-serial-tx.S itself from its
+**  listing.
+*/
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "fd-serial.h"
+
+#ifdef FDSERIAL_ASM_TX
+
+ISR(TIMER1_COMPA_vect)
+{
+	uint8_t r24;
+
+	// Drive the level set by the last interrupt
+	if (fdserial_tx_level & 1) {
+		PORTB |= S1_TX_PIN;
+	} else {
+		PORTB &= ~( S1_TX_PIN );
+	}
+
+	if (TX_STATE_REG != 2) {
+		fdserial_tx_slow();
+		return;
+	}
+
+	r24 = SEND_BYTE_REG;
+	fdserial_tx_level = r24;
+	SEND_BYTE_REG = r24 >> 1;
+
+	if (! --SEND_BITS_REG) {
+		TX_STATE_REG = 3;
+#if FRAME_TAIL_BITS > 1
+		SEND_BITS_REG = FRAME_TAIL_BITS;
+#endif
+	}
+}
+
+#endif
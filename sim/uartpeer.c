@@ -0,0 +1,484 @@
+/*
+**  Tullnet Full Duplex Serial UART - simavr benchmark peer
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Runs a firmware image under simavr as an ATtiny85 and plays the
+**  other end of its serial line: bytes are injected on PB2 and the
+**  echo is captured from PB3.
+**
+**  The injection rate is raised step by step, first by shrinking the
+**  idle gap between frames, then by running the peer's clock fast,
+**  until the firmware loses a byte. Each step reports bytes/sec
+**  echoed, and the captured edges give the error of every bit
+**  period relative to the nominal rate.
+**
+**  With -p, the firmware is taken to be built with FDSERIAL_PROFILE_PIN
+**  on that PORTB bit, and the time it stays high, the cycles spent in
+**  each Timer1 handler, is tabled over the whole sweep. Each TX and RX
+**  state shows up as its own line.
+**
+**  The frame format and TX pin default to 8N1 on PB3. Give the ones
+**  the firmware was built with: -d data bits, -e n, e or o for the
+**  parity, -s stop bits, and -t 1 for FDSERIAL_USI_TX, which sends
+**  on PB1.
+**
+**  Usage: uartpeer [-f cpu_freq] [-r rate] [-n bytes] [-p bit]
+**      [-d bits] [-e parity] [-s stops] [-t bit] firmware.elf
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_irq.h"
+#include "sim_cycle_timers.h"
+#include "avr_ioport.h"
+
+// Longest frame: start, 9 data bits, parity and 2 stop bits
+#define MAX_FRAME_BITS 13
+#define MAX_BYTES  4096
+
+// Time allowed for the firmware to boot and print its banner
+#define BOOT_MS    100
+
+// Time allowed after the last byte for the echo to drain, in frames
+#define DRAIN_FRAMES 100
+
+// Uncounted bytes sent after the counted ones, to flush firmware
+// which holds back a short tail: example-ring echoes only once 5
+// bytes are waiting
+#define FLUSH_BYTES 8
+
+// Longest handler timed with -p, in cycles
+#define MAX_PROFILE 1024
+
+static uint32_t opt_freq = 8000000;
+static double opt_rate = 9600;
+static int opt_bytes = 200;
+static int opt_profile = -1;
+static int opt_data = 8;
+static int opt_parity = 'n';
+static int opt_stop = 1;
+static int opt_tx = 3;
+
+// Bits per frame, from the options
+static int frame_bits;
+
+/* One step of the sweep */
+
+struct step {
+	double gap;         // idle bit times between injected frames
+	double speedup;     // peer clock error, percent
+};
+
+static const struct step steps[] = {
+	{ 4.0, 0.0 },
+	{ 2.0, 0.0 },
+	{ 1.0, 0.0 },
+	{ 0.5, 0.0 },
+	{ 0.0, 0.0 },
+	{ 0.0, 0.5 },
+	{ 0.0, 1.0 },
+	{ 0.0, 2.0 },
+	{ 0.0, 3.0 },
+	{ 0.0, 4.0 },
+	{ 0.0, 5.0 },
+};
+
+#define NR_STEPS (sizeof(steps) / sizeof(steps[0]))
+
+/* Edge timing error per bit position, over the whole sweep */
+
+static double err_sum[MAX_FRAME_BITS];
+static double err_max[MAX_FRAME_BITS];
+static long err_n[MAX_FRAME_BITS];
+
+/* Handler lengths from the profile pin, over the whole sweep */
+
+static long profile_n[MAX_PROFILE + 1];
+static avr_cycle_count_t profile_rise;
+
+struct peer {
+	avr_t *avr;
+	avr_irq_t *rx_pin;          // PB2, driven by the peer
+	double period;              // peer cycles per injected bit
+	double nominal;             // cycles per bit at the nominal rate
+	double gap;
+	double frame_start;         // cycle at which the current frame began
+	int count;                  // bytes counted, matched and timed
+	int total;                  // bytes to inject, the flush included
+	int sent;                   // frames completed
+	int bit;                    // bit of the current frame being driven
+	uint16_t out[MAX_BYTES + FLUSH_BYTES];
+
+	uint8_t tx_level;           // last level seen on PB3
+	int rx_busy;
+	avr_cycle_count_t rx_start; // cycle of the echoed start bit edge
+	int rx_bit;
+	uint16_t rx_shift;
+	int rx_bad;                 // parity or a stop bit wrong
+
+	int next;                   // index of the next unmatched injected byte
+	int matched;
+	int framing;
+	int unmatched;
+	avr_cycle_count_t first_echo;
+	avr_cycle_count_t last_echo;
+};
+
+/*
+**  The parity bit for data bits c, or 0 with no parity.
+*/
+
+static int parity_bit(uint16_t c) {
+	int p = opt_parity == 'o';
+
+	if (opt_parity == 'n') {
+		return 0;
+	}
+	for (; c; c >>= 1) {
+		p ^= c & 1;
+	}
+	return p;
+}
+
+/*
+**  Cycle timer: drive the next bit of the injected stream onto PB2.
+*/
+
+static avr_cycle_count_t peer_tx_bit(avr_t *avr, avr_cycle_count_t when, void *param) {
+	struct peer *p = param;
+	int level;
+
+	if (p->bit == 0) {
+		level = 0;
+	} else if (p->bit <= opt_data) {
+		level = (p->out[p->sent] >> (p->bit - 1)) & 1;
+	} else if (p->bit == opt_data + 1 && opt_parity != 'n') {
+		level = parity_bit(p->out[p->sent]);
+	} else {
+		level = 1;
+	}
+
+	avr_raise_irq(p->rx_pin, level);
+
+	if (++p->bit < frame_bits) {
+		return (avr_cycle_count_t) (p->frame_start + p->period * p->bit);
+	}
+
+	p->bit = 0;
+	if (++p->sent >= p->total) {
+		return 0;
+	}
+
+	p->frame_start += p->period * (frame_bits + p->gap);
+	return (avr_cycle_count_t) p->frame_start;
+}
+
+/*
+**  Match an echoed byte against the injected stream, skipping
+**  over any bytes the firmware lost.
+*/
+
+static void peer_echoed(struct peer *p, uint16_t c) {
+	int i;
+
+	for (i = p->next; i < p->sent; ++i) {
+		if (p->out[i] == c) {
+			p->next = i + 1;
+			if (i >= p->count) {
+				// Flush byte
+				return;
+			}
+			p->matched ++;
+			if (! p->first_echo) {
+				p->first_echo = p->rx_start;
+			}
+			p->last_echo = p->avr->cycle;
+			return;
+		}
+	}
+
+	p->unmatched ++;
+}
+
+/*
+**  Cycle timer: sample the echoed line in the middle of each bit.
+*/
+
+static avr_cycle_count_t peer_rx_sample(avr_t *avr, avr_cycle_count_t when, void *param) {
+	struct peer *p = param;
+	uint8_t level = p->tx_level;
+
+	if (p->rx_bit == 0) {
+		if (level) {
+			// Glitch, not a start bit
+			p->rx_busy = 0;
+			return 0;
+		}
+	} else if (p->rx_bit <= opt_data) {
+		if (level) {
+			p->rx_shift |= 1 << (p->rx_bit - 1);
+		}
+	} else if (p->rx_bit == opt_data + 1 && opt_parity != 'n') {
+		if (level != parity_bit(p->rx_shift)) {
+			p->rx_bad = 1;
+		}
+	} else {
+		// Every stop bit, not just the first
+		if (! level) {
+			p->rx_bad = 1;
+		}
+		if (p->rx_bit == frame_bits - 1) {
+			if (p->rx_bad) {
+				p->framing ++;
+			} else {
+				peer_echoed(p, p->rx_shift);
+			}
+			p->rx_busy = 0;
+			return 0;
+		}
+	}
+
+	p->rx_bit ++;
+	return p->rx_start + (avr_cycle_count_t) (p->nominal * (p->rx_bit + 0.5));
+}
+
+/*
+**  PB3 changed: start decoding a frame, or record where this edge
+**  fell relative to the ideal bit boundary.
+*/
+
+static void peer_pin_changed(struct avr_irq_t *irq, uint32_t value, void *param) {
+	struct peer *p = param;
+	avr_cycle_count_t now = p->avr->cycle;
+
+	if (value == p->tx_level) {
+		return;
+	}
+
+	p->tx_level = value;
+
+	if (! p->rx_busy) {
+		// Ignore the banner and anything else before injection starts
+		if (! value && p->sent) {
+			p->rx_busy = 1;
+			p->rx_start = now;
+			p->rx_bit = 0;
+			p->rx_shift = 0;
+			p->rx_bad = 0;
+			avr_cycle_timer_register(p->avr,
+				(avr_cycle_count_t) (p->nominal / 2), peer_rx_sample, p);
+		}
+		return;
+	}
+
+	double t = now - p->rx_start;
+	int k = (int) (t / p->nominal + 0.5);
+
+	if (k > 0 && k < frame_bits) {
+		double e = (t - k * p->nominal) * 100 / p->nominal;
+
+		if (e < 0) {
+			e = -e;
+		}
+		err_sum[k] += e;
+		err_n[k] ++;
+		if (e > err_max[k]) {
+			err_max[k] = e;
+		}
+	}
+}
+
+/*
+**  The profile pin changed: time how long it was high.
+*/
+
+static void profile_pin_changed(struct avr_irq_t *irq, uint32_t value, void *param) {
+	avr_t *avr = param;
+	avr_cycle_count_t len;
+
+	if (value) {
+		profile_rise = avr->cycle;
+		return;
+	}
+
+	if (! profile_rise) {
+		return;
+	}
+
+	len = avr->cycle - profile_rise;
+	profile_n[len < MAX_PROFILE ? len : MAX_PROFILE] ++;
+	profile_rise = 0;
+}
+
+/*
+**  Run the firmware for one step of the sweep.
+*/
+
+static int run_step(elf_firmware_t *f, const struct step *s, struct peer *p) {
+	avr_t *avr;
+	avr_irq_t *tx_pin;
+	avr_cycle_count_t start = (avr_cycle_count_t) opt_freq / 1000 * BOOT_MS;
+	avr_cycle_count_t end;
+	int state;
+	int i;
+
+	memset(p, 0, sizeof(*p));
+
+	avr = avr_make_mcu_by_name(f->mmcu);
+	if (! avr) {
+		fprintf(stderr, "uartpeer: unknown mcu %s\n", f->mmcu);
+		return -1;
+	}
+
+	avr_init(avr);
+	avr->frequency = opt_freq;
+	avr_load_firmware(avr, f);
+
+	p->avr = avr;
+	p->nominal = opt_freq / opt_rate;
+	p->period = p->nominal / (1.0 + s->speedup / 100);
+	p->gap = s->gap;
+	p->count = opt_bytes;
+	p->total = opt_bytes + FLUSH_BYTES;
+	p->frame_start = start;
+	p->tx_level = 1;
+
+	// Avoid nulls, which example-recv does not echo
+	for (i = 0; i < p->total; ++i) {
+		p->out[i] = i % ((1 << opt_data) - 1) + 1;
+	}
+
+	p->rx_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 2);
+	tx_pin = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), opt_tx);
+	avr_irq_register_notify(tx_pin, peer_pin_changed, p);
+
+	if (opt_profile >= 0) {
+		avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'),
+			opt_profile), profile_pin_changed, avr);
+	}
+
+	avr_raise_irq(p->rx_pin, 1);
+	avr_cycle_timer_register(avr, start, peer_tx_bit, p);
+
+	end = start + (avr_cycle_count_t) (p->period *
+		((frame_bits + p->gap) * p->total + frame_bits * DRAIN_FRAMES));
+
+	do {
+		state = avr_run(avr);
+	} while (state != cpu_Done && state != cpu_Crashed && avr->cycle < end);
+
+	avr_terminate(avr);
+
+	if (state == cpu_Crashed) {
+		fprintf(stderr, "uartpeer: firmware crashed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: uartpeer [-f cpu_freq] [-r rate] [-n bytes] [-p bit]"
+		" [-d bits] [-e parity] [-s stops] [-t bit] firmware.elf\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[]) {
+	elf_firmware_t f;
+	static struct peer p;
+	int first_loss = -1;
+	unsigned int i;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "f:r:n:p:d:e:s:t:")) != -1) {
+		switch (ch) {
+			case 'f': opt_freq = atol(optarg); break;
+			case 'r': opt_rate = atof(optarg); break;
+			case 'n': opt_bytes = atoi(optarg); break;
+			case 'p': opt_profile = atoi(optarg); break;
+			case 'd': opt_data = atoi(optarg); break;
+			case 'e': opt_parity = optarg[0]; break;
+			case 's': opt_stop = atoi(optarg); break;
+			case 't': opt_tx = atoi(optarg); break;
+			default: usage();
+		}
+	}
+
+	if (optind != argc - 1 || opt_bytes <= 0 || opt_bytes > MAX_BYTES
+		|| opt_profile > 7 || opt_data < 5 || opt_data > 9
+		|| (opt_parity != 'n' && opt_parity != 'e' && opt_parity != 'o')
+		|| opt_stop < 1 || opt_stop > 2 || opt_tx < 0 || opt_tx > 5) {
+		usage();
+	}
+
+	frame_bits = 1 + opt_data + (opt_parity != 'n') + opt_stop;
+
+	memset(&f, 0, sizeof(f));
+	if (elf_read_firmware(argv[optind], &f)) {
+		fprintf(stderr, "uartpeer: cannot read %s\n", argv[optind]);
+		return 1;
+	}
+
+	// The examples carry no .mmcu section
+	if (! f.mmcu[0]) {
+		strcpy(f.mmcu, "attiny85");
+	}
+	f.frequency = opt_freq;
+
+	printf("%s: %s at %u Hz, nominal %.0f bps, %d bytes per step\n",
+		argv[optind], f.mmcu, opt_freq, opt_rate, opt_bytes);
+	printf("  gap  speed  sent  echoed  lost  framing  bytes/s\n");
+
+	for (i = 0; i < NR_STEPS; ++i) {
+		double secs;
+
+		if (run_step(&f, &steps[i], &p) < 0) {
+			return 1;
+		}
+
+		secs = (double) (p.last_echo - p.first_echo) / opt_freq;
+		printf("%5.1f %+5.1f%% %5d %7d %5d %8d %8.1f\n",
+			steps[i].gap, steps[i].speedup, p.count, p.matched,
+			p.count - p.matched, p.framing,
+			secs > 0 ? p.matched / secs : 0.0);
+
+		if (first_loss < 0 && p.matched < p.count) {
+			first_loss = i;
+		}
+	}
+
+	printf("bit period error (%% of a bit, mean/max):\n");
+	for (i = 1; i < frame_bits; ++i) {
+		if (err_n[i]) {
+			printf("  bit %u: %.2f / %.2f\n", i,
+				err_sum[i] / err_n[i], err_max[i]);
+		}
+	}
+
+	if (opt_profile >= 0) {
+		printf("handler cycles with PB%d high (cycles: count):\n", opt_profile);
+		for (i = 0; i < MAX_PROFILE; ++i) {
+			if (profile_n[i]) {
+				printf("  %4u: %ld\n", i, profile_n[i]);
+			}
+		}
+		if (profile_n[MAX_PROFILE]) {
+			printf("  >%u: %ld\n", MAX_PROFILE, profile_n[MAX_PROFILE]);
+		}
+	}
+
+	if (first_loss < 0) {
+		printf("first loss: none\n");
+	} else {
+		printf("first loss: gap %.1f bits, peer %+.1f%%\n",
+			steps[first_loss].gap, steps[first_loss].speedup);
+	}
+
+	return 0;
+}
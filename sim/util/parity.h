@@ -0,0 +1,16 @@
+/*
+**  Tullnet Full Duplex Serial UART - host simulator
+**  (C) 2010, Nick Andrew <nick@tull.net>
+**
+**  Stand-in for <util/parity.h>. parity_even_bit() is 1 when val
+**  has an odd number of bits set, as on the AVR.
+*/
+
+#ifndef _SIM_UTIL_PARITY_H
+#define _SIM_UTIL_PARITY_H
+
+#include <stdint.h>
+
+#define parity_even_bit(val) ((uint8_t) __builtin_parity((uint8_t) (val)))
+
+#endif